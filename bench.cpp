@@ -0,0 +1,179 @@
+#include "headers.cpp"
+#include "broker.cpp"
+
+// BENCHMARK (control --bench [lines] [max_threads])
+// Synthetic large document: every 50th line edited locally, every 80th line
+// also edited by two remote sites. Times diff, merge and apply for growing
+// pool sizes and checks each result against the single-thread run, then
+// compares the byte kernels on long lines.
+static uint64_t benchDigest(const vector<Update> &ups)
+{
+    uint64_t h = ups.size();
+    for (const auto &u : ups)
+        h = h * 31 + lineHash(serialize_update(u));
+    return h;
+}
+
+// Byte kernels on long lines (minified code, logs): one byte changed in the
+// middle of each line, so prefix and suffix each scan half of it; the
+// delimiter scan counts '|' in a log-style line. GB/s of line scanned.
+static bool benchKernels()
+{
+    vector<const ByteKernels *> levels = byteKernelLevels();
+    const ByteKernels *saved = gBytes;
+    mt19937 rng(42);
+    const char *alphabet = "abcdefghijklmnopqrstuvwxyz0123456789(){};=+-*/,.";
+    size_t alen = strlen(alphabet);
+
+    printf("\n%10s %8s %12s %12s\n", "line bytes", "kernels", "diff GB/s", "split GB/s");
+    bool same = true;
+    for (size_t len : {120u, 4096u, 65536u, 1u << 20})
+    {
+        string a(len, ' '), log;
+        for (char &c : a)
+            c = alphabet[rng() % alen];
+        string b = a;
+        b[len / 2] ^= 1;
+        while (log.size() < len)
+            log += "ts=" + to_string(rng() % 100000) + "|lvl=info|msg=" + a.substr(0, rng() % 40) + "|";
+        log.resize(len);
+        size_t reps = max<size_t>(1, (256u << 20) / len);
+
+        size_t refDiff = 0, refSplit = 0;
+        for (const ByteKernels *k : levels)
+        {
+            gBytes = k;
+            size_t sumDiff = 0, sumSplit = 0;
+            auto t0 = chrono::steady_clock::now();
+            for (size_t r = 0; r < reps; ++r)
+            {
+                size_t p = commonPrefix(a, b);
+                sumDiff += p + commonSuffix(a, b, len - p);
+            }
+            auto t1 = chrono::steady_clock::now();
+            for (size_t r = 0; r < reps; ++r)
+            {
+                for (size_t pos = 0; (pos = findByte(log, '|', pos)) != string_view::npos; ++pos)
+                    sumSplit++;
+            }
+            auto t2 = chrono::steady_clock::now();
+
+            if (k == levels.front())
+            {
+                refDiff = sumDiff;
+                refSplit = sumSplit;
+            }
+            bool match = sumDiff == refDiff && sumSplit == refSplit;
+            same = same && match;
+            double gb = (double)len * reps / 1e9;
+            printf("%10zu %8s %12.2f %12.2f%s\n", len, k->name, gb / chrono::duration<double>(t1 - t0).count(),
+                   gb / chrono::duration<double>(t2 - t1).count(), match ? "" : "  MISMATCH");
+        }
+    }
+    gBytes = saved;
+    printf(same ? "all kernels agree with the scalar scan\n" : "KERNEL OUTPUT DIFFERS FROM SCALAR\n");
+    return same;
+}
+
+int runBench(size_t nLines, size_t maxThreads)
+{
+    gUID = "bench";
+    uint16_t me = gSites.id("bench");
+    uint16_t doc = gDocIds.id(DEFAULT_DOC_ID);
+
+    vector<string> base(nLines);
+    for (size_t i = 0; i < nLines; ++i)
+        base[i] = "line " + to_string(i) + ": the quick brown fox jumps over the lazy dog";
+    vector<string> edited = base;
+    for (size_t i = 0; i < nLines; i += 50)
+        edited[i].replace(10, 5, "EDITED-" + to_string(i));
+    vector<uint64_t> baseHash = hashLines(base), editedHash = hashLines(edited);
+
+    EpochArena remoteArena;
+    vector<Update> remote;
+    for (size_t i = 0; i < nLines; i += 80)
+    {
+        for (int s = 0; s < 2; ++s)
+        {
+            Update u;
+            u.op = Op::Replace;
+            u.site = gSites.id(s ? "peerB" : "peerA");
+            u.doc = doc;
+            u.lineNum = (int)i;
+            u.startCol = 8 + s;
+            u.endCol = 14 + s;
+            u.timestamp = (time_t)(1000 + s);
+            u.prevContent = remoteArena.copy(string_view(base[i]).substr(u.startCol, 6));
+            u.newContent = remoteArena.copy("remote" + to_string(s));
+            remote.push_back(u);
+        }
+    }
+
+    vector<size_t> counts;
+    size_t hw = max(1u, thread::hardware_concurrency());
+    size_t top = maxThreads ? maxThreads : hw;
+    for (size_t t = 1; t < top; t *= 2)
+        counts.push_back(t);
+    counts.push_back(top);
+
+    printf("lines=%zu  hardware threads=%zu\n", nLines, hw);
+    printf("%8s %10s %10s %10s %10s %8s\n", "threads", "diff ms", "merge ms", "apply ms", "total ms", "speedup");
+
+    uint64_t refDiff = 0, refMerge = 0, refDoc = 0;
+    double refTotal = 0;
+    bool same = true;
+    for (size_t t : counts)
+    {
+        WorkPool pool(t);
+        gPoolOverride = &pool;
+
+        double best[3] = {1e18, 1e18, 1e18};
+        uint64_t dDiff = 0, dMerge = 0, dDoc = 0;
+        for (int rep = 0; rep < 3; ++rep)
+        {
+            EpochArena arena;
+            auto t0 = chrono::steady_clock::now();
+            vector<Update> local = diffLinesMakeUpdates(base, baseHash, edited, editedHash, me, doc, arena);
+            auto t1 = chrono::steady_clock::now();
+
+            for (auto &u : local)
+                u.timestamp = 1001; // fixed clock so every run merges identically
+            vector<Update> all = local;
+            all.insert(all.end(), remote.begin(), remote.end());
+            vector<Update> winners = crdtMerge(all);
+            auto t2 = chrono::steady_clock::now();
+
+            vector<string> lines = base;
+            vector<uint64_t> hashes = baseHash;
+            auto t3 = chrono::steady_clock::now();
+            applyLineUpdates(lines, winners, &hashes);
+            auto t4 = chrono::steady_clock::now();
+
+            best[0] = min(best[0], chrono::duration<double, milli>(t1 - t0).count());
+            best[1] = min(best[1], chrono::duration<double, milli>(t2 - t1).count());
+            best[2] = min(best[2], chrono::duration<double, milli>(t4 - t3).count());
+            dDiff = benchDigest(local);
+            dMerge = benchDigest(winners);
+            dDoc = 0;
+            for (uint64_t h : hashes)
+                dDoc = dDoc * 31 + h;
+        }
+        gPoolOverride = nullptr;
+
+        double total = best[0] + best[1] + best[2];
+        if (t == counts.front())
+        {
+            refDiff = dDiff;
+            refMerge = dMerge;
+            refDoc = dDoc;
+            refTotal = total;
+        }
+        bool match = (dDiff == refDiff && dMerge == refMerge && dDoc == refDoc);
+        same = same && match;
+        printf("%8zu %10.2f %10.2f %10.2f %10.2f %7.2fx%s\n", t, best[0], best[1], best[2], total,
+               refTotal / total, match ? "" : "  MISMATCH");
+    }
+    printf(same ? "all pool sizes produced identical output\n" : "OUTPUT DIFFERS FROM SERIAL RUN\n");
+    same = benchKernels() && same;
+    return same ? 0 : 1;
+}
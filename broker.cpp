@@ -0,0 +1,294 @@
+#include "headers.cpp"
+#include "docs.cpp"
+#include <sys/epoll.h>
+
+// BROKER (control --broker)
+// Clients send each frame once to the broker queue. The broker stamps it with
+// a global sequence number, keeps it in a bounded history and forwards it to
+// every other registered peer over descriptors that stay open for the
+// subscriber's lifetime. Peer queues are non-blocking; frames that do not fit
+// wait in a per-subscriber backlog until epoll reports the queue writable.
+//
+// The broker only speaks mq; peers on a socket transport bypass it.
+// Clients announce themselves with H|uid|mode: mode "0" asks for the whole
+// history (fresh replica), "-" for live traffic only.
+const size_t BROKER_HISTORY = 1024;
+const size_t BROKER_MAX_BACKLOG = 4096;
+const int BROKER_TICK_MS = 200;
+
+struct BrokerSub
+{
+    string uid;
+    string qName;
+    mqd_t mq = (mqd_t)-1;
+    uint32_t epoch = 0; // registry incarnation the descriptor belongs to
+    deque<string> backlog;
+    bool wantOut = false;
+};
+
+static int gBrokerEpoll = -1;
+static map<string, BrokerSub> gBrokerSubs;
+static deque<pair<string, string>> gBrokerHistory; // (origin uid, stamped frame)
+static uint64_t gBrokerSeq = 0;
+
+static void brokerWatchOut(BrokerSub &sub, bool on)
+{
+    if (sub.wantOut == on)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = on ? (uint32_t)EPOLLOUT : 0u;
+    ev.data.ptr = &sub;
+    epoll_ctl(gBrokerEpoll, EPOLL_CTL_MOD, (int)sub.mq, &ev);
+    sub.wantOut = on;
+}
+
+static void brokerFlush(BrokerSub &sub)
+{
+    while (!sub.backlog.empty())
+    {
+        const string &f = sub.backlog.front();
+        if (mq_send(sub.mq, f.data(), f.size(), 0) == -1)
+        {
+            if (errno == EAGAIN)
+            {
+                brokerWatchOut(sub, true);
+                return;
+            }
+            perror(("broker mq_send " + sub.qName).c_str());
+        }
+        sub.backlog.pop_front();
+    }
+    brokerWatchOut(sub, false);
+}
+
+static void brokerEnqueue(BrokerSub &sub, const string &frame)
+{
+    if (sub.backlog.size() >= BROKER_MAX_BACKLOG)
+    {
+        cerr << "[" << gUID << "] WARN: backlog full for " << sub.uid << ", dropping oldest frame\n";
+        sub.backlog.pop_front();
+    }
+    sub.backlog.push_back(frame);
+}
+
+static void brokerDropSub(map<string, BrokerSub>::iterator it)
+{
+    epoll_ctl(gBrokerEpoll, EPOLL_CTL_DEL, (int)it->second.mq, nullptr);
+    mq_close(it->second.mq);
+    cerr << "[" << gUID << "] Subscriber left: " << it->first << "\n";
+    gBrokerSubs.erase(it);
+}
+
+static BrokerSub *brokerAddSub(const string &uid, const string &qName)
+{
+    mqd_t mq = mq_open(qName.c_str(), O_WRONLY | O_NONBLOCK);
+    if (mq == (mqd_t)-1)
+    {
+        perror(("broker mq_open " + qName).c_str());
+        return nullptr;
+    }
+
+    // a re-announced subscriber may have recreated its queue: swap the
+    // descriptor but keep the entry, pending epoll events still point at it
+    BrokerSub &sub = gBrokerSubs[uid];
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.ptr = &sub;
+    if (sub.mq != (mqd_t)-1)
+    {
+        epoll_ctl(gBrokerEpoll, EPOLL_CTL_DEL, (int)sub.mq, nullptr);
+        mq_close(sub.mq);
+        sub.backlog.clear();
+        sub.wantOut = false;
+    }
+    sub.uid = uid;
+    sub.qName = qName;
+    sub.mq = mq;
+    epoll_ctl(gBrokerEpoll, EPOLL_CTL_ADD, (int)mq, &ev);
+    cerr << "[" << gUID << "] Subscriber joined: " << uid << " (" << qName << ")\n";
+    return &sub;
+}
+
+// Reconcile subscribers with the registry whenever its generation moves:
+// pick up peers that joined without announcing themselves, reopen the queue
+// of any that re-registered and forget the ones that left.
+static void brokerSyncSubs(ShmRegistry *reg)
+{
+    static uint32_t seenGen = 0;
+    static bool synced = false;
+    uint32_t gen = __atomic_load_n(&reg->generation, __ATOMIC_SEQ_CST);
+    if (synced && gen == seenGen)
+        return;
+    seenGen = gen;
+    synced = true;
+
+    set<string> live;
+    for (size_t i = 0; i < MAX_USERS; ++i)
+    {
+        if (__atomic_load_n(&reg->users[i].active, __ATOMIC_SEQ_CST) != 1)
+            continue;
+        string uid = string(reg->users[i].uid);
+        if (uid.empty())
+            continue;
+        string qn = reg->users[i].qName[0] ? string(reg->users[i].qName) : (string("/mq_") + uid);
+        if (qn[0] != '/')
+            continue; // socket peers fan out among themselves
+        live.insert(uid);
+        uint32_t epoch = __atomic_load_n(&reg->users[i].epoch, __ATOMIC_SEQ_CST);
+        auto it = gBrokerSubs.find(uid);
+        if (it != gBrokerSubs.end() && it->second.epoch == epoch && it->second.qName == qn)
+            continue;
+        if (BrokerSub *sub = brokerAddSub(uid, qn))
+            sub->epoch = epoch;
+    }
+    for (auto it = gBrokerSubs.begin(); it != gBrokerSubs.end();)
+    {
+        auto cur = it++;
+        if (!live.count(cur->first))
+            brokerDropSub(cur);
+    }
+}
+
+static void brokerHello(ShmRegistry *reg, const string &msg)
+{
+    // H|uid|mode
+    size_t bar = msg.find('|', 2);
+    if (bar == string::npos)
+        return;
+    string uid = msg.substr(2, bar - 2);
+    bool catchUp = msg.compare(bar + 1, string::npos, "0") == 0;
+
+    string qn;
+    uint32_t epoch = 0;
+    for (size_t i = 0; i < MAX_USERS; ++i)
+    {
+        if (__atomic_load_n(&reg->users[i].active, __ATOMIC_SEQ_CST) == 1 && uid == reg->users[i].uid)
+        {
+            qn = reg->users[i].qName[0] ? string(reg->users[i].qName) : (string("/mq_") + uid);
+            epoch = __atomic_load_n(&reg->users[i].epoch, __ATOMIC_SEQ_CST);
+        }
+    }
+    if (qn.empty())
+        return;
+    BrokerSub *sub = brokerAddSub(uid, qn);
+    if (!sub)
+        return;
+    sub->epoch = epoch;
+    if (!catchUp)
+        return;
+
+    size_t replayed = 0;
+    for (const auto &h : gBrokerHistory)
+    {
+        if (h.first == uid)
+            continue;
+        brokerEnqueue(*sub, h.second);
+        replayed++;
+    }
+    if (replayed)
+        cerr << "[" << gUID << "] Catch-up for " << uid << ": " << replayed << " frame(s)\n";
+    brokerFlush(*sub);
+}
+
+static void brokerRoute(const string &frame)
+{
+    // F|uid|...
+    size_t bar = frame.find('|', 2);
+    if (bar == string::npos)
+        return;
+    string origin = frame.substr(2, bar - 2);
+
+    string stamped = "S|" + to_string(++gBrokerSeq) + "|" + frame;
+    for (auto &kv : gBrokerSubs)
+    {
+        if (kv.first == origin)
+            continue;
+        brokerEnqueue(kv.second, stamped);
+        brokerFlush(kv.second);
+    }
+
+    gBrokerHistory.emplace_back(origin, std::move(stamped));
+    if (gBrokerHistory.size() > BROKER_HISTORY)
+        gBrokerHistory.pop_front();
+}
+
+int runBroker()
+{
+    gUID = "broker";
+    gIsBroker = true;
+
+    ShmRegistry *reg = openReg();
+    if (!reg)
+    {
+        std::cerr << "Failed to open shared registry\n";
+        return 1;
+    }
+    gReg = reg;
+    resetRegIfIdle(reg);
+
+    size_t sys_max = maxSysMsgSize();
+    gMQ_msgsize = (sys_max > 0) ? std::min<size_t>(sys_max, 8192) : 8192;
+
+    if (!claimBroker(reg, BROKER_QNAME))
+    {
+        std::cerr << "[" << gUID << "] Another broker is already running\n";
+        cleanExit(1);
+    }
+    gQName = BROKER_QNAME;
+    if (!createSelfQ(gQName))
+        cleanExit(1);
+
+    // a separate non-blocking reader so the epoll loop never stalls
+    mqd_t in = mq_open(gQName.c_str(), O_RDONLY | O_NONBLOCK);
+    gBrokerEpoll = epoll_create1(0);
+    if (in == (mqd_t)-1 || gBrokerEpoll == -1)
+    {
+        perror("broker setup");
+        cleanExit(1);
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(gBrokerEpoll, EPOLL_CTL_ADD, (int)in, &ev);
+
+    std::cerr << "[" << gUID << "] Broker running on " << gQName << "\n";
+
+    vector<char> buffer(gMQ_msgsize + 10);
+    struct epoll_event events[16];
+    while (!gExit.load())
+    {
+        brokerSyncSubs(reg);
+
+        int n = epoll_wait(gBrokerEpoll, events, 16, BROKER_TICK_MS);
+        for (int e = 0; e < n; ++e)
+        {
+            if (events[e].data.ptr)
+            {
+                brokerFlush(*static_cast<BrokerSub *>(events[e].data.ptr));
+                continue;
+            }
+            for (;;)
+            {
+                ssize_t got = mq_receive(in, buffer.data(), buffer.size(), nullptr);
+                if (got < 0)
+                    break;
+                string msg(buffer.data(), static_cast<size_t>(got));
+                if (msg.compare(0, 2, "H|") == 0)
+                    brokerHello(reg, msg);
+                else if (msg.compare(0, 2, "F|") == 0)
+                    brokerRoute(msg);
+                else
+                    std::cerr << "[" << gUID << "] WARN: unexpected message on broker queue\n";
+            }
+        }
+    }
+
+    for (auto &kv : gBrokerSubs)
+        mq_close(kv.second.mq);
+    mq_close(in);
+    close(gBrokerEpoll);
+    cleanExit(0);
+    return 0;
+}
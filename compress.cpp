@@ -0,0 +1,140 @@
+#include "headers.cpp"
+#include "display.cpp"
+
+// LZ COMPRESSION (in-tree, LZ4-style block format)
+// Block layout: 4-byte little-endian raw size, then sequences of
+// token | [literal len ext] | literals | offset(2, LE) | [match len ext]
+// token high nibble = literal length, low nibble = match length - LZ_MIN_MATCH.
+// The last sequence carries literals only and ends exactly at the block end.
+const size_t LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 14;
+const size_t LZ_MAX_OFFSET = 65535;
+const size_t LZ_MAX_RAW = 64u << 20; // refuse to inflate anything larger
+
+static inline uint32_t lzRead32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static inline uint32_t lzHash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+static void lzPutLen(string &out, size_t len)
+{
+    while (len >= 255)
+    {
+        out.push_back((char)255);
+        len -= 255;
+    }
+    out.push_back((char)len);
+}
+static void lzPutSeq(string &out, const char *lit, size_t litLen, size_t offset, size_t matchLen)
+{
+    size_t ml = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    unsigned char token = (unsigned char)((min<size_t>(litLen, 15) << 4) | min<size_t>(ml, 15));
+    out.push_back((char)token);
+    if (litLen >= 15)
+        lzPutLen(out, litLen - 15);
+    out.append(lit, litLen);
+    if (!matchLen)
+        return;
+    out.push_back((char)(offset & 0xff));
+    out.push_back((char)(offset >> 8));
+    if (ml >= 15)
+        lzPutLen(out, ml - 15);
+}
+
+string lzCompress(const string &in)
+{
+    const size_t n = in.size();
+    const char *src = in.data();
+    string out;
+    out.reserve(n / 2 + 16);
+    for (int b = 0; b < 4; ++b)
+        out.push_back((char)((n >> (8 * b)) & 0xff));
+
+    vector<int32_t> table(size_t(1) << LZ_HASH_BITS, -1);
+    size_t i = 0, anchor = 0;
+    unsigned misses = 0;
+    while (i + LZ_MIN_MATCH <= n)
+    {
+        uint32_t v = lzRead32(src + i);
+        uint32_t h = lzHash(v);
+        int32_t cand = table[h];
+        table[h] = (int32_t)i;
+        if (cand >= 0 && i - (size_t)cand <= LZ_MAX_OFFSET && lzRead32(src + cand) == v)
+        {
+            size_t len = LZ_MIN_MATCH;
+            while (i + len < n && src[cand + len] == src[i + len])
+                len++;
+            lzPutSeq(out, src + anchor, i - anchor, i - (size_t)cand, len);
+            i += len;
+            anchor = i;
+            misses = 0;
+            continue;
+        }
+        // skip faster through incompressible stretches
+        i += 1 + (misses++ >> 6);
+    }
+    lzPutSeq(out, src + anchor, n - anchor, 0, 0);
+    return out;
+}
+
+bool lzDecompress(const string &in, string &out)
+{
+    if (in.size() < 4)
+        return false;
+    size_t raw = 0;
+    for (int b = 0; b < 4; ++b)
+        raw |= (size_t)(unsigned char)in[b] << (8 * b);
+    if (raw > LZ_MAX_RAW)
+        return false;
+
+    out.clear();
+    out.reserve(raw);
+    size_t ip = 4;
+    const size_t end = in.size();
+    auto getLen = [&](size_t &len) -> bool
+    {
+        unsigned char c;
+        do
+        {
+            if (ip >= end)
+                return false;
+            c = (unsigned char)in[ip++];
+            len += c;
+        } while (c == 255);
+        return true;
+    };
+
+    while (ip < end)
+    {
+        unsigned char token = (unsigned char)in[ip++];
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !getLen(litLen))
+            return false;
+        if (ip + litLen > end || out.size() + litLen > raw)
+            return false;
+        out.append(in, ip, litLen);
+        ip += litLen;
+        if (ip == end)
+            break; // final literal-only sequence
+
+        if (ip + 2 > end)
+            return false;
+        size_t offset = (unsigned char)in[ip] | ((size_t)(unsigned char)in[ip + 1] << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !getLen(matchLen))
+            return false;
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out.size() || out.size() + matchLen > raw)
+            return false;
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < matchLen; ++k)
+            out.push_back(out[from + k]); // byte-wise: matches may overlap
+    }
+    return out.size() == raw;
+}
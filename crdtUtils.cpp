@@ -1,80 +1,91 @@
 #include "headers.cpp"
-#include "display.cpp"
+#include "stages.cpp"
 
-// LISTENER THREAD
-void listenerThreadFunc(const string &qName)
+// LISTENER THREAD (receive stage, see PIPELINE STAGES)
+// Hand one received message on to where it is handled, waiting for room
+// rather than dropping it: a sequenced one is already acked.
+static void handleReceived(string &&msg)
 {
-    mqd_t mq = mq_open(qName.c_str(), O_RDONLY);
-    if (mq == (mqd_t)-1)
+    if (msg.compare(0, 2, "R|") == 0)
     {
-        perror(("listener mq_open " + qName).c_str());
+        lock_guard<mutex> lk(gLineReqMu);
+        gLineRequests.push_back(std::move(msg));
+        wakeMainLoop();
         return;
     }
 
-    struct mq_attr attr;
-    (void)mq_getattr(mq, &attr);
+    if (gRelayFanout && msg.compare(0, 2, "F|") == 0)
+    {
+        // passed on only once decoded here too, then never again
+        if (wireRelaySeen(msg))
+            return;
+        string frame = msg;
+        if (!postDecode(std::move(msg)))
+            return;
+        wireRelayRemember(frame);
+        lock_guard<mutex> lk(gRelayMu);
+        gRelayOut.push_back(std::move(frame));
+        wakeMainLoop();
+        return;
+    }
 
-    std::cerr << "[" << gUID << "] Listener running on " << qName << "\n";
+    postDecode(std::move(msg));
+}
 
-    vector<char> buffer(gMQ_msgsize + 10);
+void listenerThreadFunc()
+{
+    std::cerr << "[" << gUID << "] Listener running on " << gQName << " (" << gTransport->name() << ")\n";
 
+    string msg;
+    LinkHeader link;
+    vector<string> ready;
     while (!gExit.load())
     {
-        ssize_t n = mq_receive(mq, buffer.data(), buffer.size(), nullptr);
-
-        if (n >= 0)
+        if (!gTransport->receive(msg, 200))
+            continue;
+        traceRecord(TRACE_RAW, msg);
+        if (msg.compare(0, 2, "A|") == 0)
         {
-            string s(buffer.data(), static_cast<size_t>(n));
-
-            bool pushed = gRingRecv.push(s);
-            if (!pushed)
-            {
-                std::cerr << "[" << gUID << "] WARN: recv ring full, dropping message\n";
-            }
-            else
-            {
-                Update tmp;
-                if (updateDeserialize(s, tmp))
-                {
-                    g_recent_notifications.push_back(
-                        "Received update from " + tmp.uid +
-                        ": Line " + std::to_string(tmp.lineNum) + " modified");
-                    g_show_merge_message = true;
-                }
-                else
-                {
-                    std::cerr << "[" << gUID << "] Received (badly formed) message\n";
-                }
-            }
+            gSender.ack(std::move(msg));
+            continue;
         }
-        else
+        if (!linkUnwrap(msg, link))
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-
-            sleepMS(50);
+            handleReceived(std::move(msg));
+            continue;
         }
+        // sequenced messages are handed on in order, each once
+        if (linkInjectLoss())
+            continue;
+        ready.clear();
+        linkAccept(link, std::move(msg), ready);
+        for (string &m : ready)
+            handleReceived(std::move(m));
     }
-
-    mq_close(mq);
 }
 
-// CRDT MERGE (LWW)
-bool collisionUpdates(const Update &a, const Update &b)
+// REGISTRY WATCHER THREAD
+// Sleeps on the registry notify futex so joins, leaves and writes to shared
+// documents show up at once instead of on the next poll.
+void registryWatcherFunc(ShmRegistry *reg)
 {
-    if (a.lineNum != b.lineNum)
+    uint32_t seen = __atomic_load_n(&reg->notify, __ATOMIC_SEQ_CST);
+    while (!gExit.load())
     {
-        return false;
+        uint32_t now = regWaitNotify(reg, seen, 500);
+        if (now != seen)
+        {
+            seen = now;
+            wakeMainLoop();
+        }
     }
+    wakeMainLoop(); // let the main loop see gExit without waiting out its poll
+}
 
-    int aStart = (a.startCol < a.endCol ? a.startCol : a.endCol);
-    int aEnd   = (a.startCol > a.endCol ? a.startCol : a.endCol);
-
-    int bStart = (b.startCol < b.endCol ? b.startCol : b.endCol);
-    int bEnd   = (b.startCol > b.endCol ? b.startCol : b.endCol);
-
+// CRDT MERGE (LWW)
+// Spans of one line, start <= end; an empty span is an insertion point.
+static bool spansCollide(int aStart, int aEnd, int bStart, int bEnd)
+{
     int aLen = std::max(0, aEnd - aStart);
     int bLen = std::max(0, bEnd - bStart);
 
@@ -99,47 +110,112 @@ bool collisionUpdates(const Update &a, const Update &b)
     // Both are range edits: detect half-open interval overlap
     return (aStart < bEnd && bStart < aEnd);
 }
+bool collisionUpdates(const Update &a, const Update &b)
+{
+    if (a.lineNum != b.lineNum)
+    {
+        return false;
+    }
+    return spansCollide(min(a.startCol, a.endCol), max(a.startCol, a.endCol),
+                        min(b.startCol, b.endCol), max(b.startCol, b.endCol));
+}
 bool updatesAonB(const Update &a, const Update &b)
 {
     if (a.timestamp == b.timestamp)
     {
-        return (a.uid < b.uid);
+        return a.site != b.site && gSites.name(a.site) < gSites.name(b.site);
     }
 
     return (a.timestamp > b.timestamp);
 }
+static bool ownSite(uint16_t site)
+{
+    thread_local string uid;
+    thread_local uint16_t id = 0;
+    if (uid != gUID)
+    {
+        uid = gUID;
+        id = gSites.id(gUID);
+    }
+    return site == id;
+}
+// A replica's own edits are made in order: none is beaten by an earlier one
+// of its own, whatever their stamps (a clock that stepped back).
+static bool stampBeats(time_t ts, uint16_t site, const Update &u)
+{
+    if (site == u.site && ownSite(site))
+        return false;
+    if (ts == u.timestamp)
+    {
+        return site != u.site && gSites.name(site) < gSites.name(u.site);
+    }
+    return ts > u.timestamp;
+}
 
+// Updates only collide within a line, so each line's bucket is resolved on
+// its own (in parallel for large batches). Buckets keep arrival order and the
+// output keeps input order, so the result matches the all-pairs scan.
 vector<Update> crdtMerge(const vector<Update> &all)
 {
     const size_t n = all.size();
-    vector<bool> keep(n, true);
+    vector<char> keep(n, 1); // not vector<bool>: buckets are written concurrently
 
-    for (size_t i = 0; i < n; ++i)
+    vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+    {
+        return all[a].lineNum < all[b].lineNum;
+    });
+    vector<size_t> bucketStart;
+    for (size_t k = 0; k < n; ++k)
     {
-        if (keep[i])
+        if (k == 0 || all[order[k]].lineNum != all[order[k - 1]].lineNum)
         {
-            const Update &ui = all[i];
+            bucketStart.push_back(k);
+        }
+    }
+    bucketStart.push_back(n);
 
-            for (size_t j = i + 1; j < n; ++j)
+    auto resolve = [&](size_t b0, size_t b1)
+    {
+        for (size_t b = b0; b < b1; ++b)
+        {
+            for (size_t p = bucketStart[b]; p < bucketStart[b + 1]; ++p)
             {
-                if (keep[j])
+                size_t i = order[p];
+                if (!keep[i])
                 {
-                    const Update &uj = all[j];
+                    continue;
+                }
+                const Update &ui = all[i];
 
-                    if (collisionUpdates(ui, uj))
+                for (size_t q = p + 1; q < bucketStart[b + 1]; ++q)
+                {
+                    size_t j = order[q];
+                    if (keep[j] && collisionUpdates(ui, all[j]))
                     {
-                        if (updatesAonB(ui, uj))
+                        if (updatesAonB(ui, all[j]))
                         {
-                            keep[j] = false;
+                            keep[j] = 0;
                         }
                         else
                         {
-                            keep[i] = false;
+                            keep[i] = 0;
                         }
                     }
                 }
             }
         }
+    };
+
+    size_t buckets = bucketStart.size() - 1;
+    if (n >= PAR_MERGE_MIN_UPDATES)
+    {
+        workPool().parallelFor(buckets, max<size_t>(1, buckets / (4 * workPool().size())), resolve);
+    }
+    else
+    {
+        resolve(0, buckets);
     }
 
     vector<Update> out;
@@ -154,58 +230,260 @@ vector<Update> crdtMerge(const vector<Update> &all)
     return out;
 }
 
+// Recorded spans of u's line that collide with it: the one reaching over its
+// start, then every span starting inside it. O(log k) to find them.
+template <class Fn>
+static void lwwForColliding(const vector<LwwSpan> &spans, int start, int end, Fn fn)
+{
+    auto it = lower_bound(spans.begin(), spans.end(), start,
+                          [](const LwwSpan &s, int col) { return s.start < col; });
+    if (it != spans.begin() && spansCollide(prev(it)->start, prev(it)->end, start, end))
+        fn(size_t(prev(it) - spans.begin()));
+    for (; it != spans.end() && (it->start < end || it->start == start); ++it)
+    {
+        if (spansCollide(it->start, it->end, start, end))
+            fn(size_t(it - spans.begin()));
+    }
+}
+
+// True if an update already applied to u's span wins against u under LWW.
+// A catch-up copy (stamped 0, see SUBSCRIPTIONS) is never stale: the spans
+// that came with it are recorded instead.
+bool lwwStale(const WinnerIndex &idx, const Update &u)
+{
+    if (u.timestamp == 0)
+        return false;
+    auto line = idx.find(u.lineNum);
+    if (line == idx.end())
+        return false;
+    bool stale = false;
+    lwwForColliding(line->second, min(u.startCol, u.endCol), max(u.startCol, u.endCol), [&](size_t k)
+    {
+        const LwwSpan &s = line->second[k];
+        stale = stale || stampBeats(s.timestamp, s.site, u);
+    });
+    return stale;
+}
+
+// u is being applied: it replaces the spans it collides with. With
+// `newLen` (the length of its new text) it is an edit: spans past it move
+// with the text it shifts and it is recorded over the text it leaves. A
+// negative newLen records u's span as it is (a span from another index).
+static void lwwRecord(WinnerIndex &idx, const Update &u, int newLen)
+{
+    stampSeen(u.timestamp);
+    int start = min(u.startCol, u.endCol), end = max(u.startCol, u.endCol);
+    vector<LwwSpan> &spans = idx[u.lineNum];
+    vector<size_t> hit;
+    lwwForColliding(spans, start, end, [&](size_t k) { hit.push_back(k); });
+    for (size_t k = hit.size(); k-- > 0;)
+        spans.erase(spans.begin() + hit[k]);
+
+    int recEnd = end;
+    if (newLen >= 0)
+    {
+        int delta = newLen - (end - start);
+        auto past = lower_bound(spans.begin(), spans.end(), end,
+                                [](const LwwSpan &sp, int col) { return sp.start < col; });
+        for (; delta && past != spans.end(); ++past)
+        {
+            past->start += delta;
+            past->end += delta;
+        }
+        recEnd = start + newLen;
+        // a deletion brings the span just past it onto its own point: the
+        // one that wins under LWW stays
+        hit.clear();
+        lwwForColliding(spans, start, recEnd, [&](size_t k) { hit.push_back(k); });
+        for (size_t k : hit)
+        {
+            if (stampBeats(spans[k].timestamp, spans[k].site, u))
+                return;
+        }
+        for (size_t k = hit.size(); k-- > 0;)
+            spans.erase(spans.begin() + hit[k]);
+    }
+    LwwSpan s{start, recEnd, u.timestamp, u.site};
+    auto at = upper_bound(spans.begin(), spans.end(), s,
+                          [](const LwwSpan &a, const LwwSpan &b) { return a.start < b.start; });
+    spans.insert(at, s);
+    if (spans.size() > LWW_SPANS_PER_LINE)
+    {
+        // an update older than the dropped entry is only judged within its batch
+        auto oldest = min_element(spans.begin(), spans.end(), [](const LwwSpan &a, const LwwSpan &b)
+                                  { return a.timestamp < b.timestamp; });
+        spans.erase(oldest);
+    }
+}
+
+// Drop merge winners that lose to an earlier merge and record the rest.
+// `newLens` gives each update's new text length when it travels without it
+// (-1: a span, recorded as it is); by default it is the update's content.
+vector<Update> lwwAdmit(WinnerIndex &idx, const vector<Update> &wins, const vector<int> *newLens = nullptr)
+{
+    vector<Update> out;
+    vector<int> lens;
+    out.reserve(wins.size());
+    for (size_t k = 0; k < wins.size(); ++k)
+    {
+        const Update &u = wins[k];
+        if (lwwStale(idx, u))
+            continue;
+        out.push_back(u);
+        lens.push_back(newLens ? (*newLens)[k] : (int)u.newContent.size());
+    }
+    for (size_t k = 0; k < out.size(); ++k)
+    {
+        if (out[k].timestamp != 0)
+            lwwRecord(idx, out[k], lens[k]);
+    }
+    return out;
+}
+
+// Record winner spans taken from another index (a snapshot, a catch-up
+// copy's stamps), as they are; the ones that pass admission are returned.
+vector<Update> lwwAdmitSpans(WinnerIndex &idx, const vector<Update> &spans)
+{
+    vector<int> asIs(spans.size(), -1);
+    return lwwAdmit(idx, spans, &asIs);
+}
 
-void applyLineUpdates(vector<string> &lines, const vector<Update> &wins)
+// APPLY
+// Winners carry columns relative to the line their author saw, and crdtMerge
+// leaves at most one winner per span, so each line is rebuilt once: walk its
+// winners in column order, copying untouched bytes between them. When given,
+// `hashes` is kept in step with `lines`.
+// A lone winner spanning the whole line (lines of a pasted block, fetched
+// lines) is copied over it in place; false if u leaves part of the line.
+static bool applyWholeLine(string &line, const Update &u)
 {
+    if (u.startCol > 0 || (u.op == Op::Insert ? !line.empty() : u.endCol < (int)line.size()))
+    {
+        return false;
+    }
+    if (u.op == Op::Delete)
+    {
+        line.clear();
+    }
+    else
+    {
+        line.assign(u.newContent.data(), u.newContent.size());
+    }
+    return true;
+}
+
+void applyLineUpdates(vector<string> &lines, const vector<Update> &wins, vector<uint64_t> *hashes = nullptr)
+{
+    vector<const Update *> order;
+    order.reserve(wins.size());
     for (const auto &u : wins)
     {
         if (u.lineNum >= 0)
         {
-            if (static_cast<size_t>(u.lineNum) >= lines.size())
-            {
-                lines.resize(u.lineNum + 1);
-            }
+            order.push_back(&u);
+        }
+    }
+
+    std::stable_sort(order.begin(), order.end(), [](const Update *a, const Update *b)
+    {
+        if (a->lineNum != b->lineNum)
+            return a->lineNum < b->lineNum;
+        if (a->startCol != b->startCol)
+            return a->startCol < b->startCol;
+        return a->endCol < b->endCol;
+    });
+
+    if (!order.empty() && static_cast<size_t>(order.back()->lineNum) >= lines.size())
+    {
+        lines.resize(order.back()->lineNum + 1);
+    }
+    if (hashes && hashes->size() != lines.size())
+    {
+        hashes->resize(lines.size(), lineHash(string_view()));
+    }
 
-            string &line = lines[u.lineNum];
+    vector<size_t> groupStart;
+    for (size_t k = 0; k < order.size(); ++k)
+    {
+        if (k == 0 || order[k]->lineNum != order[k - 1]->lineNum)
+        {
+            groupStart.push_back(k);
+        }
+    }
+    groupStart.push_back(order.size());
 
-            if (u.toDo == "delete")
+    // every group owns a distinct line (and hash slot), so groups can run
+    // on the pool without further synchronisation
+    auto applyGroups = [&](size_t g0, size_t g1)
+    {
+        for (size_t g = g0; g < g1; ++g)
+        {
+            const size_t i = groupStart[g], j = groupStart[g + 1];
+            const int lineNum = order[i]->lineNum;
+            if (j == i + 1 && applyWholeLine(lines[lineNum], *order[i]))
             {
-                int start = std::max(0, u.startCol);
-                int len = std::max(0, u.endCol - u.startCol);
-
-                if (start < static_cast<int>(line.size()))
+                if (hashes)
                 {
-                    line.erase(static_cast<size_t>(start), static_cast<size_t>(len));
+                    (*hashes)[lineNum] = lineHash(lines[lineNum]);
                 }
+                continue;
             }
-            else if (u.toDo == "insert")
+            size_t grow = 0;
+            for (size_t k = i; k < j; ++k)
             {
-                int pos = std::max(0, u.startCol);
-                if (pos > static_cast<int>(line.size()))
-                {
-                    pos = static_cast<int>(line.size());
-                }
-                line.insert(static_cast<size_t>(pos), u.newContent);
+                grow += order[k]->newContent.size();
             }
-            else if (u.toDo == "replace")
-            {
-                int start = std::max(0, u.startCol);
-                int len = std::max(0, u.endCol - u.startCol);
 
-                if (start > static_cast<int>(line.size()))
+            const string &line = lines[lineNum];
+            const size_t len = line.size();
+            string out;
+            out.reserve(len + grow);
+
+            size_t cursor = 0;
+            for (size_t k = i; k < j; ++k)
+            {
+                const Update &u = *order[k];
+                size_t start = std::min<size_t>(std::max(0, u.startCol), len);
+                size_t end = std::min<size_t>(std::max({0, u.startCol, u.endCol}), len);
+                if (u.op == Op::Insert)
                 {
-                    start = static_cast<int>(line.size());
+                    end = start;
                 }
 
-                line.erase(static_cast<size_t>(start), static_cast<size_t>(len));
-                line.insert(static_cast<size_t>(start), u.newContent);
+                // never step back over bytes an earlier winner already consumed
+                start = std::max(start, cursor);
+                end = std::max(end, start);
+
+                out.append(line, cursor, start - cursor);
+                if (u.op != Op::Delete)
+                {
+                    out += u.newContent;
+                }
+                cursor = end;
+            }
+            out.append(line, cursor, string::npos);
+            lines[lineNum].swap(out);
+            if (hashes)
+            {
+                (*hashes)[lineNum] = lineHash(lines[lineNum]);
             }
         }
+    };
+
+    size_t groups = groupStart.size() - 1;
+    if (groups >= PAR_APPLY_MIN_LINES)
+    {
+        workPool().parallelFor(groups, max<size_t>(1, groups / (4 * workPool().size())), applyGroups);
+    }
+    else
+    {
+        applyGroups(0, groups);
     }
 }
 
 // CLEANUP
-void cleanExit(int code)
+// Leave the registry and close our endpoint; threads must already be joined.
+void releaseReplica()
 {
     gExit.store(true);
 
@@ -217,7 +495,19 @@ void cleanExit(int code)
         deregSlot(gReg, gMySlot);
     }
 
-    clearSelfQ(gQName);
+    if (hasRegistry && gIsBroker)
+    {
+        releaseBroker(gReg);
+    }
+
+    if (gTransport)
+    {
+        gTransport->closeSelf();
+    }
+    else
+    {
+        clearSelfQ(gQName);
+    }
 
     if (hasRegistry)
     {
@@ -232,14 +522,10 @@ void cleanExit(int code)
         gShmFd = -1;
         close(fd);
     }
-
-    exit(code);
 }
 
-void signalHandler(int signum)
+void cleanExit(int code)
 {
-    std::cerr << "\n[" << gUID << "] Signal " << signum << " -> cleaning up" << std::endl;
-
-    int exitCode = 0;
-    cleanExit(exitCode);
+    releaseReplica();
+    exit(code);
 }
@@ -2,7 +2,7 @@
 #include "file.cpp"
 
 // DISPLAY
-static string dispBoundesup(const string &s)
+static string dispBoundesup(string_view s)
 {
     if (s.empty())
     {
@@ -32,17 +32,17 @@ static string dispBoundesup(const string &s)
 
 string updateClassification(const Update &u)
 {
-    if (u.toDo == "insert")
+    if (u.op == Op::Insert)
     {
         return "[INSERTED]";
     }
 
-    if (u.toDo == "delete")
+    if (u.op == Op::Delete)
     {
         return "[DELETED]";
     }
 
-    if (u.toDo == "replace")
+    if (u.op == Op::Replace)
     {
         size_t old_len = u.prevContent.size();
         size_t new_len = u.newContent.size();
@@ -58,8 +58,53 @@ string updateClassification(const Update &u)
     return "[MODIFIED]";
 }
 
-void dispDocUpdatesSimp(const string &user_doc, const vector<string> &lines, ShmRegistry *reg)
+// What one redraw shows, detached from the replica so the render stage can
+// draw it while the main loop moves on.
+struct RenderFrame
 {
+    string path;
+    string hosting; // " doc* notes" when several documents are hosted
+    vector<string> lines;
+    vector<string> baseline; // lines as last drawn; differences are highlighted
+    EpochArena arena;        // payloads of edits
+    vector<Update> edits;
+    vector<string> notes; // merge notifications, shown instead of the idle line
+};
+
+// Main thread. The snapshot becomes the document's new display baseline.
+RenderFrame renderSnapshot(Document &doc)
+{
+    RenderFrame f;
+    f.path = doc.path;
+    if (gDocs.size() > 1)
+    {
+        for (const auto &kv : gDocs)
+            f.hosting += " " + kv.first + (&kv.second == &doc ? "*" : "");
+    }
+    f.lines = doc.observed;
+    f.baseline = doc.lastDispLines;
+    for (const auto &u : doc.prevEdits)
+    {
+        Update c = u;
+        c.prevContent = f.arena.copy(u.prevContent);
+        c.newContent = f.arena.copy(u.newContent);
+        f.edits.push_back(c);
+    }
+    if (g_show_merge_message)
+        f.notes = g_recent_notifications;
+
+    size_t shown = max(doc.lastDispLines.size(), doc.observed.size());
+    doc.lastDispLines = doc.observed;
+    doc.lastDispLines.resize(shown);
+    return f;
+}
+
+void renderFrame(const RenderFrame &f, ShmRegistry *reg)
+{
+    const vector<string> &lines = f.lines;
+    const vector<string> &lastDisp = f.baseline;
+    const vector<Update> &prevEdits = f.edits;
+
     const string RESET = "\033[0m";
     const string RED   = "\033[31m";
     const string GRN   = "\033[32m";
@@ -68,28 +113,25 @@ void dispDocUpdatesSimp(const string &user_doc, const vector<string> &lines, Shm
     const string DIM   = "\033[2m";
 
     cout << "\033[H\033[J";
-    cout << "Document: " << user_doc << "\n";
+    cout << "Document: " << f.path << "\n";
+    if (!f.hosting.empty())
+        cout << "Hosting:" << f.hosting << "\n";
     cout << "Last updated: " << currStr() << "\n";
     cout << "----------------------------------------\n";
 
-    size_t countPrev = gLastDispLines.size();
+    size_t countPrev = lastDisp.size();
     size_t currCount = lines.size();
     size_t currDisp  = std::max(countPrev, currCount);
 
-    if (gLastDispLines.size() < currDisp)
-    {
-        gLastDispLines.resize(currDisp);
-    }
-
     for (size_t i = 0; i < currDisp; ++i)
     {
-        const string prev = (i < gLastDispLines.size()) ? gLastDispLines[i] : string();
+        const string prev = (i < lastDisp.size()) ? lastDisp[i] : string();
         const string cur  = (i < currCount) ? lines[i] : string();
 
         bool found_change_for_line = false;
         Update change_for_line;
 
-        for (const auto &u : gPrevEdits)
+        for (const auto &u : prevEdits)
         {
             if ((size_t)u.lineNum == i)
             {
@@ -105,7 +147,7 @@ void dispDocUpdatesSimp(const string &user_doc, const vector<string> &lines, Shm
         {
             const string cls = updateClassification(change_for_line);
 
-            if (change_for_line.toDo == "delete")
+            if (change_for_line.op == Op::Delete)
             {
                 outLine = RED + string("[DELETED]") + RESET + " " + cls;
             }
@@ -147,29 +189,21 @@ void dispDocUpdatesSimp(const string &user_doc, const vector<string> &lines, Shm
         }
 
         cout << BLU << "Line " << i << ":" << RESET << " " << outLine << "\n";
-        gLastDispLines[i] = cur;
     }
 
     cout << "----------------------------------------\nActive users: ";
     {
         bool first = true;
-        for (size_t i = 0; i < MAX_USERS; ++i)
+        for (const string &uid : regMembers(reg))
         {
-            if (__atomic_load_n(&reg->users[i].active, __ATOMIC_SEQ_CST) == 1)
-            {
-                string uid = string(reg->users[i].uid);
-                if (!uid.empty())
-                {
-                    if (!first) cout << ", ";
-                    cout << uid;
-                    first = false;
-                }
-            }
+            if (!first) cout << ", ";
+            cout << uid;
+            first = false;
         }
     }
     cout << "\n";
 
-    for (const auto &u : gPrevEdits)
+    for (const auto &u : prevEdits)
     {
         string cls      = updateClassification(u);
         string old_disp = dispBoundesup(u.prevContent);
@@ -185,9 +219,9 @@ void dispDocUpdatesSimp(const string &user_doc, const vector<string> &lines, Shm
 
     cout << "\n";
 
-    if (g_show_merge_message && !g_recent_notifications.empty())
+    if (!f.notes.empty())
     {
-        for (const auto &msg : g_recent_notifications)
+        for (const auto &msg : f.notes)
             cout << msg << "\n";
     }
     else
@@ -198,6 +232,11 @@ void dispDocUpdatesSimp(const string &user_doc, const vector<string> &lines, Shm
     cout.flush();
 }
 
+void dispDocUpdatesSimp(Document &doc, ShmRegistry *reg)
+{
+    renderFrame(renderSnapshot(doc), reg);
+}
+
 // MESSAGE QUEUE HELPERS (robust)
 size_t gMQ_msgsize = 4096; // determined at runtime
 int gMQ_maxmsg = MQ_MAXMSG_DEFAULT;
@@ -232,52 +271,6 @@ bool createSelfQ(const string &qName)
     return true;
 }
 
-bool sendRetriesUpdatesToQ(const string &qName, const string &msg, int retries, int delay_ms)
-{
-    for (int attempt = 0; attempt < retries && !gExit.load(); ++attempt)
-    {
-        mqd_t mq = mq_open(qName.c_str(), O_WRONLY);
-        if (mq == (mqd_t)-1)
-        {
-            // Queue does not exist or is not accessible yet; retry after delay
-            if (errno == ENOENT || errno == EACCES)
-            {
-                sleepMS(delay_ms);
-                continue;
-            }
-
-            // Any other error: also pause and retry
-            sleepMS(delay_ms);
-            continue;
-        }
-
-        if (msg.size() > gMQ_msgsize)
-        {
-            cerr << "[" << gUID << "] ERROR: message too large for mq (size="
-                 << msg.size() << " max=" << gMQ_msgsize << ")\n";
-            mq_close(mq);
-            return false;
-        }
-
-        int ret = mq_send(mq, msg.data(), msg.size(), 0);
-        if (ret == -1)
-        {
-            perror(("mq_send " + qName).c_str());
-            mq_close(mq);
-            sleepMS(delay_ms);
-            continue;
-        }
-
-        mq_close(mq);
-        cerr << "[" << gUID << "] Sent to " << qName << " ("
-             << msg.size() << " bytes)\n";
-        return true;
-    }
-
-    cerr << "[" << gUID << "] WARN: failed to send to "
-         << qName << " after retries\n";
-    return false;
-}
 void clearSelfQ(const string &qName)
 {
     if (gMQ != (mqd_t)-1)
@@ -0,0 +1,923 @@
+#include "headers.cpp"
+#include "shmdoc.cpp"
+
+// DOCUMENTS
+// Every hosted document keeps its own replica state; the queue, the listener
+// thread and the main poll/merge loop are shared by all of them. Display
+// baselines are only kept for the focused document, and pending vectors are
+// released after each merge, so idle documents cost little beyond their text.
+bool validDocId(const string &id)
+{
+    if (id.empty() || id.size() >= DOC_ID_LEN)
+        return false;
+    for (char c : id)
+    {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-')
+            return false;
+    }
+    return true;
+}
+
+// Winner spans of lines [lo, hi) as payload-less updates (stamps records).
+static vector<Update> winnerSpans(const Document &d, int lo, int hi)
+{
+    vector<Update> spans;
+    for (const auto &kv : d.winners)
+    {
+        if (kv.first < lo || kv.first >= hi)
+            continue;
+        for (const LwwSpan &s : kv.second)
+        {
+            Update u;
+            u.doc = gDocIds.id(d.id);
+            u.lineNum = kv.first;
+            u.startCol = s.start;
+            u.endCol = s.end;
+            u.timestamp = s.timestamp;
+            u.site = s.site;
+            spans.push_back(u);
+        }
+    }
+    return spans;
+}
+
+Document *openDocument(const string &id)
+{
+    Document &d = gDocs[id];
+    d.id = id;
+    d.path = gUID + "_" + id + ".txt";
+    d.seeded = verifyLocalDoc(d.path, id);
+
+    struct stat fst;
+    if (stat(d.path.c_str(), &fst) != 0)
+        perror("stat initial");
+    else
+        d.seen = fileStamp(fst);
+    // a snapshot of an earlier file does not describe a freshly seeded one
+    if (!d.seeded && snapshotLoad(d, d.seen))
+    {
+        d.snapshotFresh = true;
+        std::cerr << "[" << gUID << "] Loaded " << d.id << " from snapshot (" << d.lines.size() << " lines)\n";
+    }
+    else
+    {
+        d.lines = readLinesFile(d.path, &d.linesHash);
+        d.observed = d.lines;
+        d.observedHash = d.linesHash;
+    }
+    d.snapshotAt = time(nullptr);
+    traceDocument(id, d.lines);
+    if (gTracing.load(memory_order_relaxed) && !d.winners.empty())
+        traceRecord(TRACE_WINNERS, serializeStamps(id, winnerSpans(d, 0, INT_MAX)));
+    return &d;
+}
+
+void focusDocument(Document &d)
+{
+    if (gFocusDoc == &d)
+        return;
+    if (gFocusDoc)
+        vector<string>().swap(gFocusDoc->lastDispLines);
+    gFocusDoc = &d;
+    if (d.lastDispLines.empty())
+        d.lastDispLines = d.observed;
+}
+
+static const string &lineOf(const vector<string> &lines, int i)
+{
+    static const string EMPTY;
+    return i >= 0 && i < (int)lines.size() ? lines[i] : EMPTY;
+}
+
+// Queue a local edit already applied to d.observed; `before` is the line as
+// the edit found it. A line keeps at most one pending update for the merge
+// and one for the next broadcast: a later edit to it replaces them with a
+// diff against the text they are read against (the merged line, and the
+// line as peers last had it), so a batch never holds two updates whose
+// columns refer to different states of one line.
+static void queueLocalEdit(Document &d, const Update &u, const string &before)
+{
+    const string &now = lineOf(d.observed, u.lineNum);
+    Update m;
+
+    auto it = d.unmergedAt.find(u.lineNum);
+    if (it == d.unmergedAt.end())
+    {
+        d.unmergedAt[u.lineNum] = d.localUnmerged.size();
+        d.localUnmerged.push_back(u);
+    }
+    else if (diffLine(lineOf(d.lines, u.lineNum), now, u.lineNum, u.site, u.doc, u.timestamp, d.arena, m))
+    {
+        d.localUnmerged[it->second] = m;
+    }
+    else
+    {
+        // back to the merged text: nothing left to merge for this line
+        size_t k = it->second;
+        d.localUnmerged.erase(d.localUnmerged.begin() + k);
+        d.unmergedAt.erase(it);
+        for (auto &kv : d.unmergedAt)
+        {
+            if (kv.second > k)
+                kv.second--;
+        }
+    }
+
+    auto s = d.unsent.find(u.lineNum);
+    if (s == d.unsent.end())
+    {
+        Document::Unsent &n = d.unsent[u.lineNum];
+        n.base = before;
+        n.u = u;
+        n.u.prevContent = d.sendArena.copy(u.prevContent);
+        n.u.newContent = d.sendArena.copy(u.newContent);
+    }
+    else if (diffLine(s->second.base, now, u.lineNum, u.site, u.doc, u.timestamp, d.sendArena, m))
+    {
+        s->second.u = m;
+    }
+    else
+    {
+        d.unsent.erase(s);
+    }
+}
+
+// Re-read the file if someone else changed it; queue any local edits.
+// Returns true when the file changed on disk.
+bool pollDocument(Document &d)
+{
+    struct stat st;
+    if (stat(d.path.c_str(), &st) != 0)
+        return false;
+    FileStamp now = fileStamp(st);
+    DiskState ds = persistState(d, now);
+    if (ds == DiskState::Pending)
+        return false; // about to be replaced by a merge we made
+    if (ds == DiskState::Ours || now == d.seen)
+    {
+        d.seen = now;
+        return false;
+    }
+
+    vector<uint64_t> new_hash;
+    vector<string> new_lines = readLinesFile(d.path, &new_hash);
+    vector<Update> updates = diffLinesMakeUpdates(d.observed, d.observedHash, new_lines, new_hash,
+                                                  gSites.id(gUID), gDocIds.id(d.id), d.arena);
+
+    d.observed.swap(new_lines);
+    d.observedHash.swap(new_hash);
+    for (const Update &u : updates)
+        queueLocalEdit(d, u, lineOf(new_lines, u.lineNum));
+    if (d.lastDispLines.empty())
+        d.lastDispLines.swap(new_lines); // previous content is the display baseline
+    d.seen = now;
+
+    if (!updates.empty())
+    {
+        std::cerr << "[" << gUID << "] Detected " << updates.size() << " local update(s) in " << d.id << "\n";
+        d.prevEdits = updates;
+        g_recent_notifications.clear();
+        g_show_merge_message = false;
+    }
+    else
+    {
+        d.prevEdits.clear();
+    }
+    return true;
+}
+
+// Queue an edit submitted through the library instead of a file save. It is
+// applied to the local view at once and queued like a saved edit, so
+// keystrokes on one line within a batch go out as a single update.
+void submitLocalUpdate(Document &d, Update u)
+{
+    u.site = gSites.id(gUID);
+    u.doc = gDocIds.id(d.id);
+    u.timestamp = stampNow();
+    u.prevContent = d.arena.copy(u.prevContent);
+    u.newContent = d.arena.copy(u.newContent);
+    string before = lineOf(d.observed, u.lineNum);
+    applyLineUpdates(d.observed, {u}, &d.observedHash);
+    queueLocalEdit(d, u, before);
+    d.prevEdits.assign(1, u);
+}
+
+static int sharedLeader(const PeerCache &pc, const Document &d);
+static bool acceptShared(const Document &d, uint16_t site);
+
+// `force` sends a partial batch (library flush).
+void broadcastDocument(Document &d, ShmRegistry *reg, bool force = false)
+{
+    if (d.unsent.empty() || (!force && (int)d.unsent.size() < BROADCAST_BATCH_SIZE))
+        return;
+
+    vector<Update> ups;
+    ups.reserve(d.unsent.size());
+    for (const auto &kv : d.unsent)
+        ups.push_back(kv.second.u);
+    vector<string> records;
+    serializeUpdates(ups, records); // runs over consecutive lines go out as blocks
+
+    // with a broker running a single send replaces the fan-out below to mq
+    // peers; the broker serves only those, so socket peers are still sent to
+    // directly
+    string broker = (gTransport == &gMqTransport) ? liveBrokerQ(reg) : string();
+    if (!broker.empty())
+    {
+        vector<string> frames = wireEncodeBatch(records, gUID, gMQ_msgsize - BROKER_SEQ_RESERVE);
+        gSender.enqueue(&gMqTransport, broker, std::move(frames), false);
+    }
+
+    // relay mode: we only feed the root's children, they pass it on
+    const PeerCache &pc = peerCache(reg);
+    if (pc.relayK && broker.empty())
+    {
+        vector<string> frames = wireEncodeBatch(records, gUID, pc.minMessage);
+        for (const Peer *p : relayChildren(pc, gUID))
+            gSender.enqueue(p->t, p->endpoint, frames);
+        d.unsent.clear();
+        d.sendArena.reset();
+        return;
+    }
+
+    // frames are cut to the receiving backend's message size; peers that
+    // follow only some lines of this document get their own filtered batch
+    map<size_t, vector<string>> framesBySize;
+    for (const Peer &p : pc.peers)
+    {
+        if (!broker.empty() && p.t == &gMqTransport)
+            continue;
+        // shared-memory group members see each other's edits in the segment
+        if (p.shared.count(d.id) && (d.shared || p.slot != sharedLeader(pc, d)))
+            continue;
+        if (!p.follows(d.id))
+        {
+            vector<Update> lines;
+            for (const Update &u : ups)
+            {
+                if (p.wants(d.id, u.lineNum))
+                    lines.push_back(u);
+            }
+            vector<string> wanted;
+            serializeUpdates(lines, wanted);
+            if (!wanted.empty())
+                gSender.enqueue(p.t, p.endpoint, wireEncodeBatch(wanted, gUID, p.t->frameBudget()));
+            continue;
+        }
+        vector<string> &frames = framesBySize[p.t->frameBudget()];
+        if (frames.empty())
+            frames = wireEncodeBatch(records, gUID, p.t->frameBudget());
+        gSender.enqueue(p.t, p.endpoint, frames);
+    }
+    d.unsent.clear();
+    d.sendArena.reset();
+}
+
+bool mergeDocument(Document &d, bool force);
+
+// Winner spans that came with a catch-up copy: recorded unless we already
+// hold something newer for the same span (for the whole group when the
+// document is shared).
+static void takeStamps(const string &rec)
+{
+    vector<Update> spans;
+    if (!stampsDeserialize(rec, spans))
+    {
+        std::cerr << "[" << gUID << "] WARN: failed to deserialize incoming stamps\n";
+        return;
+    }
+    if (spans.empty())
+        return;
+    auto it = gDocs.find(gDocIds.name(spans[0].doc));
+    if (it == gDocs.end())
+        return;
+    Document &d = it->second;
+    traceRecord(TRACE_WINNERS, rec);
+    if (d.shared)
+        shmDocRecordStamps(*d.shared, spans, d.winners, d.sharedStamps);
+    else
+        lwwAdmitSpans(d.winners, spans);
+}
+
+// Drain the receive ring and route each update to its document. A batch
+// holds one update per line, but successive batches from one site may edit
+// a line again, relative to its first edit: the pending updates are merged
+// first so the two are applied in order.
+void routeIncoming()
+{
+    string serialized;
+    size_t stale = 0;
+    vector<Update> recs;
+    while (gRingRecv.pop(serialized))
+    {
+        // payloads alias the ring's copy until the record moves into the
+        // arena of the document it belongs to, in one piece
+        if (isStampsRecord(serialized))
+        {
+            takeStamps(serialized);
+            continue;
+        }
+        recs.clear();
+        if (!updatesDeserialize(serialized, recs, nullptr))
+        {
+            std::cerr << "[" << gUID << "] WARN: failed to deserialize incoming update\n";
+            continue;
+        }
+        const string &docId = gDocIds.name(recs[0].doc);
+        auto it = gDocs.find(docId);
+        if (it == gDocs.end())
+        {
+            std::cerr << "[" << gUID << "] WARN: update for unhosted document " << docId << "\n";
+            continue;
+        }
+        Document &d = it->second;
+        if (d.shared && !acceptShared(d, recs[0].site))
+            continue;
+        for (const Update &u : recs)
+        {
+            if (d.recvPending.count({u.site, u.lineNum}))
+            {
+                mergeDocument(d, true);
+                break;
+            }
+        }
+        string_view slab;
+        auto rebase = [&](string_view p)
+        {
+            return p.empty() ? string_view() : slab.substr(p.data() - serialized.data(), p.size());
+        };
+        size_t kept = 0;
+        for (Update &temp : recs)
+        {
+            if (lwwStale(d.winners, temp))
+            {
+                stale++; // older than what was applied to its span: LWW says drop
+                continue;
+            }
+            if (slab.empty())
+                slab = d.arena.copy(serialized);
+            temp.prevContent = rebase(temp.prevContent);
+            temp.newContent = rebase(temp.newContent);
+            d.recvUnmerged.push_back(temp);
+            d.recvPending.insert({temp.site, temp.lineNum});
+            kept++;
+        }
+        if (kept == 0)
+            continue;
+        string where = recs.size() == 1 ? "Line " + std::to_string(recs[0].lineNum)
+                                        : "Lines " + std::to_string(recs[0].lineNum) + "-" +
+                                              std::to_string(recs.back().lineNum);
+        g_recent_notifications.push_back("Received update from " + gSites.name(recs[0].site) + ": " + where +
+                                         " modified");
+        g_show_merge_message = true;
+    }
+    if (stale)
+        std::cerr << "[" << gUID << "] Dropped " << stale << " stale update(s)\n";
+}
+
+// Library remote-change callback: every applied winner that came from
+// another site. A callback may call back into the API, which can queue edits
+// into the arena or start another merge, so changes are queued with copies
+// of their payloads and delivered by deliverRemoteChanges() between steps.
+static function<void(const Document &, const Update &)> gRemoteApplied;
+static vector<pair<string, Update>> gRemoteQueue; // doc id, change
+static EpochArena gRemoteArena;                   // payloads of gRemoteQueue
+
+static void queueRemoteChange(const Document &d, const Update &u)
+{
+    if (!gRemoteApplied)
+        return;
+    Update c = u;
+    c.prevContent = gRemoteArena.copy(u.prevContent);
+    c.newContent = gRemoteArena.copy(u.newContent);
+    gRemoteQueue.emplace_back(d.id, c);
+}
+
+void deliverRemoteChanges()
+{
+    if (gRemoteQueue.empty())
+        return;
+    vector<pair<string, Update>> q;
+    q.swap(gRemoteQueue);
+    EpochArena held = std::move(gRemoteArena); // callbacks may queue more
+    gRemoteArena = EpochArena();
+    for (const auto &c : q)
+    {
+        auto it = gDocs.find(c.first);
+        if (it != gDocs.end() && gRemoteApplied)
+            gRemoteApplied(it->second, c.second);
+    }
+}
+
+// Record what a merge takes in so a replay merges the same batches.
+static void traceMergeBatch(const Document &d)
+{
+    if (!gTracing.load(memory_order_relaxed))
+        return;
+    for (const auto &u : d.localUnmerged)
+        traceRecord(TRACE_LOCAL, serialize_update(u));
+    for (const auto &u : d.recvUnmerged)
+        traceRecord(TRACE_RECV, serialize_update(u));
+    traceRecord(TRACE_MERGE, d.id);
+}
+
+// SHARED MODE (see shmdoc.cpp)
+// Lowest slot among the peers keeping `d` in shared memory, us included; -1
+// if nobody does. The leader is the group's only way in from outside peers.
+static int sharedLeader(const PeerCache &pc, const Document &d)
+{
+    int leader = d.shared ? gMySlot : -1;
+    for (const Peer &p : pc.peers)
+    {
+        if (p.shared.count(d.id) && (leader == -1 || p.slot < leader))
+            leader = p.slot;
+    }
+    return leader;
+}
+
+// Received updates are applied by the leader only, and never when they come
+// from a group member (the segment already holds those).
+static bool acceptShared(const Document &d, uint16_t site)
+{
+    const PeerCache &pc = peerCache(gReg);
+    if (sharedLeader(pc, d) != gMySlot)
+        return false;
+    const string &uid = gSites.name(site);
+    for (const Peer &p : pc.peers)
+    {
+        if (p.uid == uid && p.shared.count(d.id))
+            return false;
+    }
+    return true;
+}
+
+// Our copy of a shared document changed: keep the file and views in step.
+static void syncSharedFile(Document &d)
+{
+    if (d.linesHash == d.observedHash)
+        return;
+    persistDocument(d);
+    if (d.lastDispLines.empty())
+        d.lastDispLines.swap(d.observed);
+    d.observed = d.lines;
+    d.observedHash = d.linesHash;
+}
+
+// Reload a shared document other group members wrote to. Changed lines are
+// reported to the remote-change callback as whole-line replacements.
+bool reloadShared(Document &d)
+{
+    if (!d.shared || shmDocSeq(*d.shared) == d.sharedSeq)
+        return false;
+    vector<string> fresh;
+    uint32_t seq = 0;
+    if (!shmDocRead(*d.shared, fresh, seq) || seq == d.sharedSeq)
+        return false;
+    vector<uint64_t> hash = hashLines(fresh);
+
+    if (gRemoteApplied)
+    {
+        for (size_t i = 0; i < max(fresh.size(), d.lines.size()); ++i)
+        {
+            const string &was = lineOf(d.lines, (int)i);
+            const string &now = lineOf(fresh, (int)i);
+            if (was == now)
+                continue;
+            Update u;
+            u.op = Op::Replace;
+            u.site = gSites.id(SHARED_DOC_PREFIX + d.id);
+            u.doc = gDocIds.id(d.id);
+            u.lineNum = (int)i;
+            u.startCol = 0;
+            u.endCol = (int)was.size();
+            u.timestamp = stampNow();
+            u.prevContent = was;
+            u.newContent = now;
+            queueRemoteChange(d, u);
+        }
+    }
+
+    d.lines.swap(fresh);
+    d.linesHash.swap(hash);
+    d.sharedSeq = seq;
+    traceDocument(d.id, d.lines, TRACE_RELOAD);
+    syncSharedFile(d);
+    return true;
+}
+
+// Write updates into the segment, admitted under its writer lock against
+// the whole group's edits (see shmDocWrite); `ups` keeps the ones written.
+// If nobody else wrote since our last load our copy just replays them;
+// otherwise it is reloaded.
+static void sharedApply(Document &d, vector<Update> &ups)
+{
+    uint32_t before = 0, after = 0;
+    if (!shmDocWrite(*d.shared, ups, d.winners, d.sharedStamps, before, after))
+        std::cerr << "[" << gUID << "] WARN: shared write to " << d.id << " failed\n";
+    if (before != d.sharedSeq)
+    {
+        reloadShared(d);
+        return;
+    }
+    applyLineUpdates(d.lines, ups, &d.linesHash);
+    d.sharedSeq = after;
+    syncSharedFile(d);
+}
+
+// Local edits of a shared document go into the segment straight away; they
+// still reach peers outside the group through the outgoing batch. They pass
+// the same LWW admission as a merge, so the winner index records them.
+void shareLocalEdits(Document &d)
+{
+    if (!d.shared || d.localUnmerged.empty())
+        return;
+    traceMergeBatch(d);
+    vector<Update> edits;
+    edits.swap(d.localUnmerged);
+    sharedApply(d, edits);
+    d.unmergedAt.clear();
+}
+
+static void publishShared(ShmRegistry *reg)
+{
+    if (gMySlot < 0)
+        return;
+    UserShMem &me = reg->users[gMySlot];
+    uint32_t n = 0;
+    for (const auto &kv : gDocs)
+    {
+        if (!kv.second.shared || n == MAX_SHARED_DOCS)
+            continue;
+        memset(me.sharedDocs[n], 0, DOC_ID_LEN);
+        strncpy(me.sharedDocs[n], kv.first.c_str(), DOC_ID_LEN - 1);
+        n++;
+    }
+    me.numShared = n;
+    regBumpGeneration(reg);
+}
+
+// Switch `d` to shared mode; the segment wins over our copy if it exists.
+bool shareDocument(Document &d, ShmRegistry *reg)
+{
+    if (d.shared)
+        return true;
+    size_t already = 0;
+    for (const auto &kv : gDocs)
+        already += kv.second.shared ? 1 : 0;
+    if (already == MAX_SHARED_DOCS)
+    {
+        std::cerr << "[" << gUID << "] WARN: too many shared documents, " << d.id << " stays private\n";
+        return false;
+    }
+    d.shared = shmDocAttach(d.id, d.lines);
+    if (!d.shared)
+        return false;
+    d.sharedSeq = 0;
+    reloadShared(d);
+    publishShared(reg);
+    std::cerr << "[" << gUID << "] Sharing " << d.id << " through " << SHARED_DOC_PREFIX << d.id << "\n";
+    return true;
+}
+
+void unshareAll()
+{
+    for (auto &kv : gDocs)
+    {
+        shmDocDetach(kv.second.shared);
+        kv.second.shared = nullptr;
+    }
+}
+
+// Merge pending local and received updates once a batch is due, or right
+// away with `force`. Returns true when the document changed.
+bool mergeDocument(Document &d, bool force = false)
+{
+    int total_pending = (int)d.localUnmerged.size() + (int)d.recvUnmerged.size();
+    if (total_pending == 0 || (!force && total_pending < BROADCAST_BATCH_SIZE))
+        return false;
+    traceMergeBatch(d);
+
+    vector<Update> all;
+    all.reserve(total_pending);
+    all.insert(all.end(), d.localUnmerged.begin(), d.localUnmerged.end());
+    all.insert(all.end(), d.recvUnmerged.begin(), d.recvUnmerged.end());
+    vector<Update>().swap(d.localUnmerged);
+    vector<Update>().swap(d.recvUnmerged);
+    d.unmergedAt.clear();
+    d.recvPending.clear();
+
+    g_recent_notifications.clear();
+    vector<Update> winners = crdtMerge(all);
+    if (d.shared)
+    {
+        sharedApply(d, winners); // admitted against every member's edits
+    }
+    else
+    {
+        winners = lwwAdmit(d.winners, winners);
+        applyLineUpdates(d.lines, winners, &d.linesHash);
+    }
+    d.prevEdits.clear();
+
+    if (winners.empty())
+    {
+        d.arena.reset();
+        std::cerr << "[" << gUID << "] No winning updates after merge\n";
+        return false;
+    }
+    uint16_t me = gSites.id(gUID);
+    for (const auto &u : winners)
+    {
+        if (u.site != me)
+            queueRemoteChange(d, u);
+    }
+    d.arena.reset(); // end of epoch: nothing references the payloads any more
+    if (!d.shared)
+    {
+        persistDocument(d);
+
+        if (d.lastDispLines.empty())
+            d.lastDispLines.swap(d.observed);
+        d.observed = d.lines;
+        d.observedHash = d.linesHash;
+    }
+
+    bool conflict_detected = (all.size() > winners.size());
+
+    if (conflict_detected)
+        g_recent_notifications.push_back("Conflict detected and resolved using LWW");
+    else
+        g_recent_notifications.push_back("All updates merged successfully");
+
+    g_show_merge_message = true;
+    return true;
+}
+
+// Pass frames received in relay mode on to our children in the tree rooted
+// at their origin; nothing is forwarded while the group is not in relay mode.
+void relayForward(ShmRegistry *reg)
+{
+    vector<string> frames;
+    {
+        lock_guard<mutex> lk(gRelayMu);
+        frames.swap(gRelayOut);
+    }
+    const PeerCache &pc = peerCache(reg);
+    for (const string &f : frames)
+    {
+        for (const Peer *p : relayChildren(pc, f.substr(2, f.find('|', 2) - 2)))
+            gSender.enqueue(p->t, p->endpoint, {f});
+    }
+}
+
+// Acknowledge what arrived from each peer since the last step (see
+// SEQUENCED DELIVERY); acks themselves are not sequenced.
+void sendAcks(ShmRegistry *reg)
+{
+    vector<pair<string, string>> acks = linkTakeAcks();
+    if (acks.empty())
+        return;
+    const PeerCache &pc = peerCache(reg);
+    for (auto &a : acks)
+    {
+        for (const Peer &p : pc.peers)
+        {
+            if (p.uid == a.first)
+            {
+                gSender.enqueue(p.t, p.endpoint, {std::move(a.second)}, false);
+                break;
+            }
+        }
+    }
+}
+
+// SUBSCRIPTIONS (partial replication)
+// A replica may follow only some lines of a document. The ranges sit in its
+// registry slot and senders filter records per peer, so traffic and merge
+// work scale with the followed region. When the region grows, the newly
+// covered lines are fetched from a peer that follows the whole document. It
+// answers with whole-line replacements stamped with time 0, so any real edit
+// to those lines still wins within a batch, followed by its winner spans of
+// those lines (a stamps record). The copies bypass the winner index; the
+// spans go into it, so later updates to the lines are judged as the sender
+// judged them. Frames relayed by a broker are not filtered.
+bool followsLine(const Document &d, int line)
+{
+    if (d.subRanges.empty())
+        return true;
+    for (const auto &r : d.subRanges)
+    {
+        if (line >= r.first && line < r.second)
+            return true;
+    }
+    return false;
+}
+
+static void publishSubscriptions(ShmRegistry *reg)
+{
+    if (gMySlot < 0)
+        return;
+    UserShMem &me = reg->users[gMySlot];
+    uint32_t n = 0;
+    for (const auto &kv : gDocs)
+    {
+        const auto &rs = kv.second.subRanges;
+        if (rs.empty())
+            continue;
+        if (n + rs.size() > MAX_SUB_RANGES)
+        {
+            std::cerr << "[" << gUID << "] WARN: no room to publish ranges of " << kv.first
+                      << ", peers keep sending all of it\n";
+            continue;
+        }
+        for (const auto &r : rs)
+        {
+            SubRange &sr = me.ranges[n++];
+            memset(sr.docId, 0, DOC_ID_LEN);
+            strncpy(sr.docId, kv.first.c_str(), DOC_ID_LEN - 1);
+            sr.lo = r.first;
+            sr.hi = r.second;
+        }
+    }
+    me.numRanges = n;
+    regBumpGeneration(reg);
+}
+
+// Add [lo, hi) to the followed lines, joining the closest neighbours past
+// SUB_RANGES_PER_DOC. Returns the lines that were not followed before.
+static vector<pair<int, int>> addSubRange(Document &d, int lo, int hi)
+{
+    vector<pair<int, int>> before = d.subRanges;
+    vector<pair<int, int>> rs = d.subRanges;
+    rs.emplace_back(lo, hi);
+    sort(rs.begin(), rs.end());
+
+    vector<pair<int, int>> merged;
+    for (const auto &r : rs)
+    {
+        if (!merged.empty() && r.first <= merged.back().second)
+            merged.back().second = max(merged.back().second, r.second);
+        else
+            merged.push_back(r);
+    }
+    while (merged.size() > SUB_RANGES_PER_DOC)
+    {
+        size_t best = 0;
+        for (size_t i = 1; i + 1 < merged.size(); ++i)
+        {
+            if (merged[i + 1].first - merged[i].second < merged[best + 1].first - merged[best].second)
+                best = i;
+        }
+        merged[best].second = merged[best + 1].second;
+        merged.erase(merged.begin() + best + 1);
+    }
+    d.subRanges = merged;
+
+    vector<pair<int, int>> fresh;
+    for (const auto &r : merged)
+    {
+        int cur = r.first;
+        for (const auto &b : before)
+        {
+            if (b.second <= cur || b.first >= r.second)
+                continue;
+            if (b.first > cur)
+                fresh.emplace_back(cur, b.first);
+            cur = max(cur, b.second);
+        }
+        if (cur < r.second)
+            fresh.emplace_back(cur, r.second);
+    }
+    return fresh;
+}
+
+static void requestLines(const Document &d, const vector<pair<int, int>> &gaps, ShmRegistry *reg)
+{
+    const Peer *src = nullptr;
+    for (const Peer &p : peerCache(reg).peers)
+    {
+        if (p.follows(d.id))
+        {
+            src = &p;
+            break;
+        }
+    }
+    if (!src)
+    {
+        std::cerr << "[" << gUID << "] WARN: no peer follows all of " << d.id << ", new lines stay stale\n";
+        return;
+    }
+    for (const auto &g : gaps)
+    {
+        gSender.enqueue(src->t, src->endpoint,
+                        {"R|" + gUID + "|" + d.id + "|" + to_string(g.first) + "|" + to_string(g.second)});
+    }
+}
+
+// Follow lines [lo, hi) of `d`. The first call narrows a whole document to
+// that range; later calls widen it and fetch what was not followed.
+void followLines(Document &d, int lo, int hi, ShmRegistry *reg)
+{
+    if (lo < 0 || hi <= lo)
+        return;
+    bool wasWhole = d.subRanges.empty();
+    vector<pair<int, int>> fresh = addSubRange(d, lo, hi);
+    publishSubscriptions(reg);
+    if (!wasWhole && !fresh.empty())
+        requestLines(d, fresh, reg);
+}
+
+void followWholeDocument(Document &d, ShmRegistry *reg)
+{
+    if (d.subRanges.empty())
+        return;
+    vector<pair<int, int>> gaps;
+    int cur = 0;
+    for (const auto &r : d.subRanges)
+    {
+        if (r.first > cur)
+            gaps.emplace_back(cur, r.first);
+        cur = r.second;
+    }
+    gaps.emplace_back(cur, INT_MAX);
+    d.subRanges.clear();
+    publishSubscriptions(reg);
+    requestLines(d, gaps, reg);
+}
+
+// Local edits outside the followed lines widen the ranges around them.
+void followEdits(Document &d, const vector<Update> &edits, ShmRegistry *reg)
+{
+    for (const auto &u : edits)
+    {
+        if (!followsLine(d, u.lineNum))
+            followLines(d, max(0, u.lineNum - SUB_EXPAND_MARGIN), u.lineNum + SUB_EXPAND_MARGIN + 1, reg);
+    }
+}
+
+// Answer catch-up requests (R|uid|doc|lo|hi) with our copy of those lines.
+void serveLineRequests(ShmRegistry *reg)
+{
+    vector<string> reqs;
+    {
+        lock_guard<mutex> lk(gLineReqMu);
+        reqs.swap(gLineRequests);
+    }
+    for (const string &m : reqs)
+    {
+        vector<string> f;
+        size_t pos = 0;
+        for (size_t bar; (bar = m.find('|', pos)) != string::npos; pos = bar + 1)
+            f.push_back(m.substr(pos, bar - pos));
+        f.push_back(m.substr(pos));
+        if (f.size() != 5)
+            continue;
+
+        auto it = gDocs.find(f[2]);
+        const Peer *to = nullptr;
+        for (const Peer &p : peerCache(reg).peers)
+        {
+            if (p.uid == f[1])
+                to = &p;
+        }
+        if (it == gDocs.end() || !to)
+            continue;
+
+        const Document &d = it->second;
+        int lo = max(0, atoi(f[3].c_str()));
+        int hi = (int)min<long long>(atoll(f[4].c_str()), (long long)d.lines.size());
+        vector<Update> lines;
+        for (int i = lo; i < hi; ++i)
+        {
+            Update u;
+            u.op = Op::Replace;
+            u.site = gSites.id(gUID);
+            u.doc = gDocIds.id(d.id);
+            u.lineNum = i;
+            u.startCol = 0;
+            u.endCol = INT_MAX; // clamped to whatever the requester holds
+            u.timestamp = 0;
+            u.newContent = d.lines[i];
+            lines.push_back(u);
+        }
+        if (lines.empty())
+            continue;
+        vector<string> records;
+        serializeUpdates(lines, records);
+        records.push_back(serializeStamps(d.id, winnerSpans(d, lo, hi)));
+        gSender.enqueue(to->t, to->endpoint, wireEncodeBatch(records, gUID, to->t->frameBudget()));
+        std::cerr << "[" << gUID << "] Sent lines " << lo << "-" << hi << " of " << d.id << " to " << to->uid << "\n";
+    }
+}
+
+// Announce ourselves to a running broker; fresh replicas ask for its history.
+void helloBroker(ShmRegistry *reg)
+{
+    string broker = (gTransport == &gMqTransport) ? liveBrokerQ(reg) : string();
+    if (broker.empty())
+        return;
+    bool catchUp = false;
+    for (const auto &kv : gDocs)
+        catchUp = catchUp || kv.second.seeded;
+    gSender.enqueue(&gMqTransport, broker, {"H|" + gUID + "|" + (catchUp ? "0" : "-")}, false);
+}
@@ -1,16 +1,68 @@
 #include "headers.cpp"
-#include "globals.cpp"
+#include "simd.cpp"
+
+// LINE HASHING (64-bit, 8 bytes per step)
+inline uint64_t lineHash(string_view s)
+{
+    const uint64_t K1 = 0x9e3779b97f4a7c15ull;
+    const uint64_t K2 = 0xbf58476d1ce4e5b9ull;
+    uint64_t h = s.size() * K1;
+    const char *p = s.data();
+    size_t n = s.size();
+    while (n >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h ^= v * K1;
+        h = ((h << 29) | (h >> 35)) * K2;
+        p += 8;
+        n -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, n);
+    h ^= tail * K1;
+    h ^= h >> 31;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 29;
+    return h;
+}
+vector<uint64_t> hashLines(const vector<string> &lines)
+{
+    vector<uint64_t> hashes;
+    hashes.reserve(lines.size());
+    for (const auto &L : lines)
+        hashes.push_back(lineHash(L));
+    return hashes;
+}
 
 // FILE helpers
-vector<string> readLinesFile(const string &filename)
+// Reads the whole file in one go; optionally hashes each line while it is
+// still in cache.
+vector<string> readLinesFile(const string &filename, vector<uint64_t> *hashes = nullptr)
 {
     vector<string> lines;
-    ifstream ifs(filename);
-    if (!ifs.is_open())
+    if (hashes)
+        hashes->clear();
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
         return lines;
-    string line;
-    while (getline(ifs, line))
-        lines.push_back(line);
+    string buf;
+    char chunk[1 << 16];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        buf.append(chunk, got);
+    fclose(f);
+
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        const char *nl = (const char *)memchr(buf.data() + pos, '\n', buf.size() - pos);
+        size_t end = nl ? (size_t)(nl - buf.data()) : buf.size();
+        lines.emplace_back(buf, pos, end - pos);
+        if (hashes)
+            hashes->push_back(lineHash(lines.back()));
+        pos = end + 1;
+    }
     return lines;
 }
 void writeLinesFile(const string &filename, const vector<string> &lines)
@@ -19,12 +71,13 @@ void writeLinesFile(const string &filename, const vector<string> &lines)
     for (const auto &L : lines)
         ofs << L << "\n";
 }
-void verifyLocalDoc(const string &user_doc)
+// Create the replica from its base document if missing; true if it was created.
+bool verifyLocalDoc(const string &user_doc, const string &doc_id)
 {
     struct stat st;
     if (stat(user_doc.c_str(), &st) == 0)
-        return;
-    ifstream src(BASE_DOC);
+        return false;
+    ifstream src(BASE_DOC_PREFIX + doc_id + ".txt");
     ofstream dst(user_doc);
     if (!src.is_open())
     {
@@ -33,108 +86,153 @@ void verifyLocalDoc(const string &user_doc)
         dst << "Start making changes.\n";
         dst << "See real-time updates!\n";
         dst << "Come collaborate with others.\n";
-        return;
+        return true;
     }
     string line;
     while (getline(src, line))
         dst << line << "\n";
+    return true;
 }
 
 // DIFF: produce Update objects
-vector<Update> diffLinesMakeUpdates(const vector<string> &old_lines, const vector<string> &new_lines, const string &uid)
+// Diff one line; false when the two are equal. Payloads go to `arena`.
+static bool diffLine(const string &oldL, const string &newL, int line, uint16_t site, uint16_t doc, time_t ts,
+                     EpochArena &arena, Update &u)
 {
-    vector<Update> updates;
-    size_t old_n = old_lines.size();
-    size_t new_n = new_lines.size();
-    size_t max_n = max(old_n, new_n);
+    if (oldL == newL)
+        return false;
 
-    for (size_t i = 0; i < max_n; ++i)
+    u = Update();
+    u.lineNum = line;
+    u.timestamp = ts;
+    u.site = site;
+    u.doc = doc;
+
+    if (oldL.empty() && !newL.empty())
     {
-        string oldL = (i < old_n) ? old_lines[i] : string();
-        string newL = (i < new_n) ? new_lines[i] : string();
-        if (oldL == newL)
-            continue;
+        u.op = Op::Insert;
+        u.startCol = 0;
+        u.endCol = 0;
+        u.newContent = arena.copy(newL);
+        return true;
+    }
+    if (!oldL.empty() && newL.empty())
+    {
+        u.op = Op::Delete;
+        u.startCol = 0;
+        u.endCol = (int)oldL.size();
+        u.prevContent = arena.copy(oldL);
+        return true;
+    }
 
-        Update u;
-        u.lineNum = (int)i;
-        u.timestamp = time(nullptr);
-        u.uid = uid;
+    // ----- IMPROVED REPLACE DIFF -----
+    int oN = oldL.size(), nN = newL.size();
 
-        if (oldL.empty() && !newL.empty())
-        {
-            u.toDo = "insert";
-            u.startCol = 0;
-            u.endCol = 0;
-            u.newContent = newL;
-            updates.push_back(u);
-            continue;
-        }
-        if (!oldL.empty() && newL.empty())
-        {
-            u.toDo = "delete";
-            u.startCol = 0;
-            u.endCol = (int)oldL.size();
-            u.prevContent = oldL;
-            updates.push_back(u);
-            continue;
-        }
+    // Longest common prefix, then the longest common suffix of the rest
+    int prefix = (int)commonPrefix(oldL, newL);
+    int suffix = (int)commonSuffix(oldL, newL, min(oN, nN) - prefix);
 
-        // ----- IMPROVED REPLACE DIFF -----
-        int oN = oldL.size(), nN = newL.size();
-        int prefix = 0;
+    int start = prefix;
+    int end_old = oN - suffix;
+    int end_new = nN - suffix;
 
-        // Find longest common prefix
-        while (prefix < oN && prefix < nN && oldL[prefix] == newL[prefix])
-            prefix++;
+    string_view old_mid = string_view(oldL).substr(start, end_old - start);
+    string_view new_mid = string_view(newL).substr(start, end_new - start);
 
-        // Find longest common suffix
-        int suffix = 0;
-        while (suffix < (oN - prefix) && suffix < (nN - prefix) &&
-               oldL[oN - suffix - 1] == newL[nN - suffix - 1])
-            suffix++;
+    // ---------- KEY FIX: If old_mid is empty, expand left until previous space ----------
+    if (old_mid.empty() && start > 0)
+    {
+        int expand = start - 1;
+        while (expand > 0 && oldL[expand - 1] != ' ')
+            expand--;
 
-        int start = prefix;
-        int end_old = oN - suffix;
-        int end_new = nN - suffix;
+        // Now expand replacement range leftward
+        old_mid = string_view(oldL).substr(expand, end_old - expand);
+        new_mid = string_view(newL).substr(expand, end_new - expand);
+        start = expand;
+    }
 
-        string old_mid = oldL.substr(start, end_old - start);
-        string new_mid = newL.substr(start, end_new - start);
+    // Construct update
+    u.op = Op::Replace;
+    u.startCol = start;
+    u.endCol = start + old_mid.size();
+    u.prevContent = arena.copy(old_mid);
+    u.newContent = arena.copy(new_mid);
+    return true;
+}
 
-        // ---------- KEY FIX: If old_mid is empty, expand left until previous space ----------
-        if (old_mid.empty() && start > 0)
-        {
-            int expand = start - 1;
-            while (expand > 0 && oldL[expand - 1] != ' ')
-                expand--;
-
-            // Now expand replacement range leftward
-            old_mid = oldL.substr(expand, end_old - expand);
-            new_mid = newL.substr(expand, end_new - expand);
-            start = expand;
-        }
+// Lines whose cached hash and length match are skipped without touching their
+// bytes. Diffs lines [lo, hi), appending to `updates`; payloads go to `arena`.
+static void diffLineRange(const vector<string> &old_lines, const vector<uint64_t> &old_hash,
+                          const vector<string> &new_lines, const vector<uint64_t> &new_hash,
+                          size_t lo, size_t hi, uint16_t site, uint16_t doc, time_t ts,
+                          EpochArena &arena, vector<Update> &updates)
+{
+    static const string EMPTY;
+    size_t old_n = old_lines.size();
+    size_t new_n = new_lines.size();
+
+    Update u;
+    for (size_t i = lo; i < hi; ++i)
+    {
+        if (i < old_n && i < new_n && old_hash[i] == new_hash[i] &&
+            old_lines[i].size() == new_lines[i].size())
+            continue;
+        const string &oldL = (i < old_n) ? old_lines[i] : EMPTY;
+        const string &newL = (i < new_n) ? new_lines[i] : EMPTY;
+        if (diffLine(oldL, newL, (int)i, site, doc, ts, arena, u))
+            updates.push_back(u);
+    }
+}
 
-        // Construct update
-        u.toDo = "replace";
-        u.startCol = start;
-        u.endCol = start + old_mid.size();
-        u.prevContent = old_mid;
-        u.newContent = new_mid;
-        updates.push_back(u);
-        continue;
+// Large documents are split into line ranges diffed on the work pool. Each
+// range fills its own vector and arena; stitching them in range order gives
+// exactly the serial result.
+vector<Update> diffLinesMakeUpdates(const vector<string> &old_lines, const vector<uint64_t> &old_hash,
+                                    const vector<string> &new_lines, const vector<uint64_t> &new_hash,
+                                    uint16_t site, uint16_t doc, EpochArena &arena)
+{
+    vector<Update> updates;
+    time_t ts = stampNow(); // one stamp per diff, so runs of lines can travel as blocks
+    size_t max_n = max(old_lines.size(), new_lines.size());
+    if (max_n < PAR_DIFF_MIN_LINES || workPool().size() == 1)
+    {
+        diffLineRange(old_lines, old_hash, new_lines, new_hash, 0, max_n, site, doc, ts, arena, updates);
+        return updates;
     }
 
+    size_t chunks = (max_n + PAR_DIFF_GRAIN - 1) / PAR_DIFF_GRAIN;
+    vector<vector<Update>> parts(chunks);
+    vector<EpochArena> arenas(chunks);
+    workPool().parallelFor(max_n, PAR_DIFF_GRAIN, [&](size_t lo, size_t hi)
+    {
+        size_t c = lo / PAR_DIFF_GRAIN;
+        diffLineRange(old_lines, old_hash, new_lines, new_hash, lo, hi, site, doc, ts, arenas[c], parts[c]);
+    });
+
+    for (auto &part : parts)
+    {
+        for (auto &u : part)
+        {
+            u.prevContent = arena.copy(u.prevContent);
+            u.newContent = arena.copy(u.newContent);
+            updates.push_back(u);
+        }
+    }
     return updates;
 }
 
 // SERIALIZATION (compact)
 // Format:
-// toDo|line|startCol|endCol|timestamp|uid|old_len|old|new_len|new
+// op|line|startCol|endCol|timestamp|uid|docId|old_len|old|new_len|new
 // using '|' as separators and lengths to allow any char in old/new.
 string serialize_update(const Update &u)
 {
+    const string &uid = gSites.name(u.site);
+    const string &docId = gDocIds.name(u.doc);
     string s;
-    s.reserve(256 + u.prevContent.size() + u.newContent.size());
-    s += u.toDo;
+    s.reserve(64 + uid.size() + docId.size() + u.prevContent.size() + u.newContent.size());
+    s += opName(u.op);
     s += '|';
     s += to_string(u.lineNum);
     s += '|';
@@ -144,7 +242,9 @@ string serialize_update(const Update &u)
     s += '|';
     s += to_string((long long)u.timestamp);
     s += '|';
-    s += u.uid;
+    s += uid;
+    s += '|';
+    s += docId;
     s += '|';
     s += to_string(u.prevContent.size());
     s += '|';
@@ -155,58 +255,270 @@ string serialize_update(const Update &u)
     s += u.newContent;
     return s;
 }
-bool updateDeserialize(const string &s, Update &out)
+
+// Reads the '|'-separated fields of a record in place.
+struct FieldReader
 {
-    size_t pos = 0, next = 0;
-    auto extractToken = [&](string &tok) -> bool
+    string_view v;
+    size_t pos = 0;
+
+    bool token(string_view &tok)
     {
-        next = s.find('|', pos);
-        if (next == string::npos)
+        size_t next = findByte(v, '|', pos);
+        if (next == string_view::npos)
             return false;
-        tok = s.substr(pos, next - pos);
+        tok = v.substr(pos, next - pos);
         pos = next + 1;
         return true;
-    };
-    string tok;
-    if (!extractToken(tok))
+    }
+    bool num(long long &n)
+    {
+        string_view tok;
+        if (!token(tok) || tok.empty())
+            return false;
+        auto r = from_chars(tok.data(), tok.data() + tok.size(), n);
+        return r.ec == errc() && r.ptr == tok.data() + tok.size();
+    }
+    // <len>|<len bytes>, aliasing v
+    bool payload(string_view &dst)
+    {
+        long long len;
+        if (!num(len) || len < 0 || (size_t)len > v.size() - pos)
+            return false;
+        dst = v.substr(pos, (size_t)len);
+        pos += (size_t)len;
+        return true;
+    }
+    // old_len|old|new_len|new
+    bool payloads(Update &u)
+    {
+        if (!payload(u.prevContent) || pos >= v.size() || v[pos] != '|')
+            return false;
+        pos++;
+        return payload(u.newContent);
+    }
+};
+
+// Header fields are parsed in place; only the two payloads are copied, into
+// `arena`. With a null arena the payloads alias `s`.
+bool updateDeserialize(const string &s, Update &out, EpochArena *arena)
+{
+    FieldReader r{s};
+    string_view tok;
+    long long n;
+    if (!r.token(tok) || !opFromName(tok, out.op))
         return false;
-    out.toDo = tok;
-    if (!extractToken(tok))
+    if (!r.num(n))
         return false;
-    out.lineNum = stoi(tok);
-    if (!extractToken(tok))
+    out.lineNum = (int)n;
+    if (!r.num(n))
         return false;
-    out.startCol = stoi(tok);
-    if (!extractToken(tok))
+    out.startCol = (int)n;
+    if (!r.num(n))
         return false;
-    out.endCol = stoi(tok);
-    if (!extractToken(tok))
+    out.endCol = (int)n;
+    if (!r.num(n))
         return false;
-    out.timestamp = (time_t)stoll(tok);
-    if (!extractToken(tok))
+    out.timestamp = (time_t)n;
+    if (!r.token(tok))
         return false;
-    out.uid = tok;
+    out.site = gSites.id(tok);
+    if (!r.token(tok))
+        return false;
+    out.doc = gDocIds.id(tok);
+
+    if (!r.payloads(out))
+        return false;
+    if (arena)
+    {
+        out.prevContent = arena->copy(out.prevContent);
+        out.newContent = arena->copy(out.newContent);
+    }
+    return true;
+}
+
+// BLOCKS
+// A run of updates to consecutive lines with the same op, author, document
+// and timestamp (a paste, a bulk delete, the lines a peer asked for) travels
+// as one record: the header once, then per line its columns and payloads.
+// block|op|firstLine|count|timestamp|uid|docId|{startCol|endCol|old_len|old|new_len|new}*count
+// Inside a replica they are ordinary per-line updates again, so merge and
+// the winner index are unchanged.
+const char WIRE_BLOCK_TAG[] = "block|";
+const size_t WIRE_BLOCK_MAX_LINES = 4096;
+
+inline bool isBlockRecord(const string &s)
+{
+    return s.compare(0, sizeof(WIRE_BLOCK_TAG) - 1, WIRE_BLOCK_TAG) == 0;
+}
+
+static bool blockContinues(const Update &prev, const Update &u)
+{
+    return u.op == prev.op && u.site == prev.site && u.doc == prev.doc && u.timestamp == prev.timestamp &&
+           u.lineNum == prev.lineNum + 1;
+}
+
+static string serializeBlock(const Update *u, size_t n)
+{
+    if (n == 1)
+        return serialize_update(*u);
+    const string &uid = gSites.name(u->site);
+    const string &docId = gDocIds.name(u->doc);
+    size_t bytes = 64 + uid.size() + docId.size();
+    for (size_t k = 0; k < n; ++k)
+        bytes += 32 + u[k].prevContent.size() + u[k].newContent.size();
+    string s;
+    s.reserve(bytes);
+    s += WIRE_BLOCK_TAG;
+    s += opName(u->op);
+    s += '|';
+    s += to_string(u->lineNum);
+    s += '|';
+    s += to_string(n);
+    s += '|';
+    s += to_string((long long)u->timestamp);
+    s += '|';
+    s += uid;
+    s += '|';
+    s += docId;
+    s += '|';
+    for (size_t k = 0; k < n; ++k)
+    {
+        s += to_string(u[k].startCol);
+        s += '|';
+        s += to_string(u[k].endCol);
+        s += '|';
+        s += to_string(u[k].prevContent.size());
+        s += '|';
+        s += u[k].prevContent;
+        s += '|';
+        s += to_string(u[k].newContent.size());
+        s += '|';
+        s += u[k].newContent;
+    }
+    return s;
+}
+
+// Append `updates` to `out` in order, packing runs into block records.
+void serializeUpdates(const vector<Update> &updates, vector<string> &out)
+{
+    for (size_t i = 0, j; i < updates.size(); i = j)
+    {
+        j = i + 1;
+        while (j < updates.size() && j - i < WIRE_BLOCK_MAX_LINES && blockContinues(updates[j - 1], updates[j]))
+            ++j;
+        out.push_back(serializeBlock(&updates[i], j - i));
+    }
+}
+
+// Either record form. A block's payloads are copied into `arena` as one
+// slice that every line of it points into. Appends to `out`; nothing is
+// appended when the record is malformed.
+bool updatesDeserialize(const string &s, vector<Update> &out, EpochArena *arena)
+{
+    if (!isBlockRecord(s))
+    {
+        Update u;
+        if (!updateDeserialize(s, u, arena))
+            return false;
+        out.push_back(u);
+        return true;
+    }
 
-    if (!extractToken(tok))
-        return false; // old_len
-    size_t old_len = (size_t)stoul(tok);
-    if (pos + old_len > s.size())
+    FieldReader r{s, sizeof(WIRE_BLOCK_TAG) - 1};
+    Update u;
+    string_view tok;
+    long long first, count, ts;
+    if (!r.token(tok) || !opFromName(tok, u.op) || !r.num(first) || !r.num(count) || count < 1 ||
+        count > (long long)WIRE_BLOCK_MAX_LINES || first < 0 || first > INT_MAX - count || !r.num(ts))
+        return false;
+    u.timestamp = (time_t)ts;
+    if (!r.token(tok))
         return false;
-    out.prevContent = s.substr(pos, old_len);
-    pos += old_len;
+    u.site = gSites.id(tok);
+    if (!r.token(tok))
+        return false;
+    u.doc = gDocIds.id(tok);
 
-    if (pos >= s.size() || s[pos] != '|')
+    // entries are parsed from the arena copy, so payloads land there for free
+    string_view body = r.v.substr(r.pos);
+    FieldReader e{arena ? arena->copy(body) : body};
+    size_t base = out.size();
+    for (long long k = 0; k < count; ++k)
+    {
+        long long startCol, endCol;
+        if (!e.num(startCol) || !e.num(endCol) || !e.payloads(u))
+        {
+            out.resize(base);
+            return false;
+        }
+        u.lineNum = (int)(first + k);
+        u.startCol = (int)startCol;
+        u.endCol = (int)endCol;
+        out.push_back(u);
+    }
+    if (e.pos != e.v.size())
+    {
+        out.resize(base);
         return false;
-    pos++;
+    }
+    return true;
+}
+
+// STAMPS
+// LWW winner spans of some lines, without their text. They travel after a
+// catch-up copy (see SUBSCRIPTIONS) so the requester judges later updates to
+// those lines as the sender does; each span is a payload-less Update.
+// stamps|docId|count|{line|startCol|endCol|timestamp|uid|}*count
+const char WIRE_STAMPS_TAG[] = "stamps|";
 
-    next = s.find('|', pos);
-    if (next == string::npos)
+inline bool isStampsRecord(const string &s)
+{
+    return s.compare(0, sizeof(WIRE_STAMPS_TAG) - 1, WIRE_STAMPS_TAG) == 0;
+}
+
+string serializeStamps(const string &docId, const vector<Update> &spans)
+{
+    string s = WIRE_STAMPS_TAG + docId + "|" + to_string(spans.size()) + "|";
+    for (const Update &u : spans)
+    {
+        s += to_string(u.lineNum) + "|" + to_string(u.startCol) + "|" + to_string(u.endCol) + "|" +
+             to_string((long long)u.timestamp) + "|" + gSites.name(u.site) + "|";
+    }
+    return s;
+}
+
+bool stampsDeserialize(const string &s, vector<Update> &out)
+{
+    if (!isStampsRecord(s))
         return false;
-    string new_len_tok = s.substr(pos, next - pos);
-    pos = next + 1;
-    size_t new_len = (size_t)stoul(new_len_tok);
-    if (pos + new_len > s.size())
+    FieldReader r{s, sizeof(WIRE_STAMPS_TAG) - 1};
+    string_view tok;
+    long long count;
+    if (!r.token(tok) || !r.num(count) || count < 0)
         return false;
-    out.newContent = s.substr(pos, new_len);
+    Update u;
+    u.doc = gDocIds.id(tok);
+    size_t base = out.size();
+    for (long long k = 0; k < count; ++k)
+    {
+        long long line, start, end, ts;
+        if (!r.num(line) || !r.num(start) || !r.num(end) || !r.num(ts) || !r.token(tok))
+        {
+            out.resize(base);
+            return false;
+        }
+        u.lineNum = (int)line;
+        u.startCol = (int)start;
+        u.endCol = (int)end;
+        u.timestamp = (time_t)ts;
+        u.site = gSites.id(tok);
+        out.push_back(u);
+    }
+    if (r.pos != s.size())
+    {
+        out.resize(base);
+        return false;
+    }
     return true;
 }
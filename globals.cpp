@@ -1,43 +1,226 @@
 #include "headers.cpp"
 
 // CONFIG
-const char *SHM_NAME = "/synctext_registry_v1";
+const char *SHM_NAME = "/synctext_registry_v6";
 const size_t MAX_USERS = 5;
 const size_t uid_LEN = 32;
 const size_t NAME_QLEN = 64;
-const char *BASE_DOC = "base_doc.txt";
+const char *BASE_DOC_PREFIX = "base_"; // base_<doc id>.txt seeds new replicas
+const char *DEFAULT_DOC_ID = "doc"; // <uid>_doc.txt
+const size_t DOC_ID_LEN = 64;
 const int POLL_INTERVAL_SEC = 2;
 // Set to 1 for immediate broadcast during testing; change to 5 for spec behavior.
 const int BROADCAST_BATCH_SIZE = 5;
 const size_t RECV_RING_upBoundACITY = 4096;
+const size_t STAGE_RING_CAPACITY = 256; // persist/render snapshots in flight
 const int MQ_MAXMSG_DEFAULT = 10;
+const char *BROKER_QNAME = "/synctext_broker";
+const size_t BROKER_SEQ_RESERVE = 32; // room for the broker's "S|<seq>|" prefix
+const size_t MAX_SUB_RANGES = 16;     // line ranges one replica can publish
+const size_t SUB_RANGES_PER_DOC = 4;  // neighbours are joined beyond this
+const int SUB_EXPAND_MARGIN = 32;     // lines followed around an edit outside the ranges
+const size_t MAX_SHARED_DOCS = 8;     // documents one replica can keep in shared memory
+const char *SHARED_DOC_PREFIX = "/synctext_doc_"; // shm segment of a shared document
+const size_t LWW_SPANS_PER_LINE = 64; // winner index entries kept per line; the oldest go first
 static bool g_show_merge_message = false;
 static vector<string> g_recent_notifications;
 
 // SHARED REGISTRY
+struct SubRange
+{
+    char docId[DOC_ID_LEN];
+    int32_t lo, hi; // lines [lo, hi)
+};
 struct UserShMem
 {
     char uid[uid_LEN];
     char qName[NAME_QLEN];
     int active; // 0 or 1
+    uint32_t epoch; // bumped on every registration; a change means a new incarnation
+    // documents listed here are only followed within their ranges; every
+    // other document replicates whole (published with a generation bump)
+    uint32_t numRanges;
+    SubRange ranges[MAX_SUB_RANGES];
+    uint32_t relayFanout; // k of the relay tree this peer takes part in; 0 = direct only
+    // documents this peer reads and writes through their shared segment
+    uint32_t numShared;
+    char sharedDocs[MAX_SHARED_DOCS][DOC_ID_LEN];
 };
 struct ShmRegistry
 {
     UserShMem users[MAX_USERS];
     int numUsers;
+    // bumped (and futex-woken) on every join, leave or endpoint change
+    uint32_t generation;
+    // futex word the watcher sleeps on: moves with the generation and with
+    // every write to a shared document segment
+    uint32_t notify;
+    // optional fan-out broker (control --broker)
+    int brokerActive; // 0 or 1
+    int brokerPid;
+    char brokerQName[NAME_QLEN];
 };
 
 // UPDATE (logical)
+enum class Op : uint8_t
+{
+    Insert,
+    Delete,
+    Replace
+};
+inline const char *opName(Op op)
+{
+    switch (op)
+    {
+        case Op::Insert:
+            return "insert";
+        case Op::Delete:
+            return "delete";
+        default:
+            return "replace";
+    }
+}
+inline bool opFromName(string_view s, Op &op)
+{
+    if (s == "insert")
+        op = Op::Insert;
+    else if (s == "delete")
+        op = Op::Delete;
+    else if (s == "replace")
+        op = Op::Replace;
+    else
+        return false;
+    return true;
+}
+
+// INTERNED NAMES (site uids, doc ids) -> small integer ids
+class Interner
+{
+    mutable mutex mu;
+    unordered_map<string, uint16_t> ids;
+    deque<string> names; // deque: references stay valid while it grows
+
+public:
+    uint16_t id(string_view s)
+    {
+        lock_guard<mutex> lk(mu);
+        auto it = ids.find(string(s));
+        if (it != ids.end())
+            return it->second;
+        if (names.size() >= 0xffff)
+        {
+            cerr << "WARN: interner full, reusing id 0\n";
+            return 0;
+        }
+        names.emplace_back(s);
+        uint16_t i = (uint16_t)(names.size() - 1);
+        ids.emplace(names.back(), i);
+        return i;
+    }
+    const string &name(uint16_t i) const
+    {
+        lock_guard<mutex> lk(mu);
+        return names.at(i);
+    }
+};
+static Interner gSites;
+static Interner gDocIds;
+
+// Content slices point into the owning Document's EpochArena and stay valid
+// until that document's next merge resets it.
 struct Update
 {
-    string toDo; // "insert", "delete", "replace"
+    Op op = Op::Insert;
+    uint16_t site = 0; // gSites id of the author
+    uint16_t doc = 0;  // gDocIds id
     int lineNum = 0;
     int startCol = 0;
     int endCol = 0;
-    string prevContent;
-    string newContent;
     time_t timestamp = 0;
-    string uid;
+    string_view prevContent;
+    string_view newContent;
+};
+
+// LWW STAMPS
+// An update's stamp is nanoseconds of wall clock, kept past every stamp this
+// replica has applied (a hybrid logical clock): an edit made here beats
+// everything it could have seen, within one second too, and when the clock
+// steps back.
+static atomic<int64_t> gStampClock{0};
+
+time_t stampNow()
+{
+    int64_t now = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    int64_t last = gStampClock.load(memory_order_relaxed), next;
+    do
+        next = max(last + 1, now);
+    while (!gStampClock.compare_exchange_weak(last, next, memory_order_relaxed));
+    return (time_t)next;
+}
+
+// A stamp applied here: later local edits are stamped past it.
+void stampSeen(time_t ts)
+{
+    int64_t last = gStampClock.load(memory_order_relaxed);
+    while (last < (int64_t)ts && !gStampClock.compare_exchange_weak(last, (int64_t)ts, memory_order_relaxed))
+    {
+    }
+}
+
+// LWW WINNER INDEX
+// Latest winning stamp per column span of each line, kept across merges so a
+// late update is judged against everything applied before it, not only its
+// own batch (lwwStale / lwwAdmit in crdtUtils.cpp). Spans of a line are
+// sorted by start and never collide with each other; an edit recorded moves
+// the spans past it with the text it shifts.
+struct LwwSpan
+{
+    int start, end; // end == start for an insertion point
+    time_t timestamp;
+    uint16_t site;
+};
+using WinnerIndex = unordered_map<int, vector<LwwSpan>>; // by line
+
+// ARENA (bump allocator, reset once per merge epoch)
+class EpochArena
+{
+    static const size_t BLOCK = 64 * 1024;
+    vector<unique_ptr<char[]>> blocks;
+    vector<unique_ptr<char[]>> large; // payloads too big to share a block
+    size_t used = 0;
+
+public:
+    string_view copy(string_view s)
+    {
+        if (s.empty())
+            return string_view();
+        char *p;
+        if (s.size() > BLOCK / 4)
+        {
+            large.emplace_back(new char[s.size()]);
+            p = large.back().get();
+        }
+        else
+        {
+            if (blocks.empty() || used + s.size() > BLOCK)
+            {
+                blocks.emplace_back(new char[BLOCK]);
+                used = 0;
+            }
+            p = blocks.back().get() + used;
+            used += s.size();
+        }
+        memcpy(p, s.data(), s.size());
+        return string_view(p, s.size());
+    }
+    // Drop everything but one block, which the next epoch reuses.
+    void reset()
+    {
+        if (blocks.size() > 1)
+            blocks.erase(blocks.begin() + 1, blocks.end());
+        large.clear();
+        used = 0;
+    }
 };
 
 // GLOBALS
@@ -49,39 +232,152 @@ string gQName;
 mqd_t gMQ = (mqd_t)-1;
 atomic<bool> gExit{false};
 
-// Track last displayed lines for terminal stable updates and modification marking
-static vector<string> gLastDispLines;
-// Track latest change summaries (local diffs or merged winners) to show
-static vector<Update> gPrevEdits;
+// WAKEUPS (let a producer cut a consumer's sleep short)
+struct StageWake
+{
+    mutex mu;
+    condition_variable cv;
+    bool pending = false;
+
+    void notify()
+    {
+        {
+            lock_guard<mutex> lk(mu);
+            pending = true;
+        }
+        cv.notify_one();
+    }
+    // Sleep up to `ms`; true if woken early (or asked to exit, with exitWakes).
+    bool wait(int ms, bool exitWakes = false)
+    {
+        unique_lock<mutex> lk(mu);
+        bool woken = cv.wait_for(lk, chrono::milliseconds(ms),
+                                 [this, exitWakes] { return pending || (exitWakes && gExit.load()); });
+        pending = false;
+        return woken;
+    }
+};
+static StageWake gMainWake;
+void wakeMainLoop()
+{
+    gMainWake.notify();
+}
+bool waitMainLoop(int ms)
+{
+    return gMainWake.wait(ms, true);
+}
+
+// Identity of a file version: a rename or any write changes it.
+struct FileStamp
+{
+    uint64_t ino = 0;
+    int64_t mtimeNs = 0;
+    int64_t size = -1;
+    bool operator==(const FileStamp &o) const { return ino == o.ino && mtimeNs == o.mtimeNs && size == o.size; }
+    bool operator!=(const FileStamp &o) const { return !(*this == o); }
+};
+FileStamp fileStamp(const struct stat &st)
+{
+    FileStamp s;
+    s.ino = st.st_ino;
+    s.mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    s.size = st.st_size;
+    return s;
+}
+
+struct ShmDoc; // shared segment of a document (shmdoc.cpp)
+
+// DOCUMENTS (one replica per hosted document; all share the queue and threads)
+struct Document
+{
+    string id;
+    string path; // <uid>_<id>.txt
+    vector<string> lines;    // merged replica state
+    vector<string> observed; // local view: file as last read plus directly submitted edits
+    vector<uint64_t> linesHash;    // lineHash() of each entry of lines
+    vector<uint64_t> observedHash; // lineHash() of each entry of observed
+    FileStamp seen;          // file version last read or written back
+    uint64_t persistGen = 0; // last snapshot of lines meant for the file
+    bool persistPending = false; // ...not handed to the persist stage yet
+    time_t snapshotAt = 0;    // last snapshot handed to the persist stage (snapshot.cpp)
+    uint64_t snapshotGen = 0; // persistGen it was taken at
+    bool snapshotFresh = false; // a .snap of snapshotGen exists or is queued
+    bool seeded = false; // created from its base document this run
+    EpochArena arena;      // payloads of every pending Update below
+    vector<Update> localUnmerged;
+    vector<Update> recvUnmerged;
+    map<int, size_t> unmergedAt;        // line -> its one update in localUnmerged
+    set<pair<uint16_t, int>> recvPending; // (site, line) of each recvUnmerged entry
+    // Local edits not sent yet, one per line, in line order. base is the
+    // line as peers last had it from us; payloads live in sendArena, which
+    // is reset once they are sent.
+    struct Unsent
+    {
+        Update u;
+        string base;
+    };
+    map<int, Unsent> unsent;
+    EpochArena sendArena;
+    WinnerIndex winners;     // every update applied so far, by line and span
+    // Track latest change summaries (local diffs or merged winners) to show
+    vector<Update> prevEdits;
+    // Track last displayed lines for terminal stable updates and modification marking
+    vector<string> lastDispLines;
+    // lines this replica follows, sorted and disjoint; empty = whole document
+    vector<pair<int, int>> subRanges;
+    // shared mode: canonical state lives in this segment; lines is the copy
+    // loaded at seqlock version sharedSeq
+    ShmDoc *shared = nullptr;
+    uint32_t sharedSeq = 0;
+    uint64_t sharedStamps = 0; // segment stamps recorded in winners so far
+};
+static map<string, Document> gDocs;
+static Document *gFocusDoc = nullptr; // document currently rendered
 
 // SPSC RING (lock-free)
-struct ringRecv
+// Connects the pipeline stages: one producer thread, one consumer thread.
+template <class T>
+struct SpscRing
 {
-    vector<string> buffer; // store serialized messages (producer pushes strings)
+    vector<T> buffer;
     const size_t upBound;
     atomic<size_t> front, end;
-    ringRecv(size_t c) : buffer(c), upBound(c), front(0), end(0) {}
-    bool push(const string &s)
+    SpscRing(size_t c) : buffer(c), upBound(c), front(0), end(0) {}
+    // Moves from `v` only when there is room.
+    bool push(T &&v)
     {
         size_t t = end.load(memory_order_relaxed);
         size_t next = (t + 1) % upBound;
         if (next == front.load(memory_order_acquire))
             return false; // full
-        buffer[t] = s;
+        buffer[t] = std::move(v);
         end.store(next, memory_order_release);
         return true;
     }
-    bool pop(string &out)
+    bool push(const T &v)
+    {
+        T copy = v;
+        return push(std::move(copy));
+    }
+    bool pop(T &out)
     {
         size_t h = front.load(memory_order_relaxed);
         if (h == end.load(memory_order_acquire))
             return false; // empty
-        out = buffer[h];
+        out = std::move(buffer[h]);
         front.store((h + 1) % upBound, memory_order_release);
         return true;
     }
 };
-ringRecv gRingRecv(RECV_RING_upBoundACITY);
+SpscRing<string> gRingRecv(RECV_RING_upBoundACITY); // decode stage -> main loop: update records
+bool gIsBroker = false;
+// received frames waiting to be forwarded down the relay tree
+static mutex gRelayMu;
+static vector<string> gRelayOut;
+static uint32_t gRelayFanout = 0; // ours, as published in the registry
+// line catch-up requests (R|uid|doc|lo|hi) handed from the listener to the main loop
+static mutex gLineReqMu;
+static vector<string> gLineRequests;
 
 // UTILS
 string currStr()
@@ -144,6 +440,47 @@ bool atomicCASActive(int *active_ptr, int expected, int desired)
     return __atomic_compare_exchange_n(active_ptr, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
 }
 
+// MEMBERSHIP GENERATION (futex word in the shared registry)
+void regNotify(ShmRegistry *reg)
+{
+    __atomic_add_fetch(&reg->notify, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &reg->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+void regBumpGeneration(ShmRegistry *reg)
+{
+    __atomic_add_fetch(&reg->generation, 1, __ATOMIC_SEQ_CST);
+    regNotify(reg);
+}
+// Block until the notify word moves past `seen` (or timeout); returns it.
+uint32_t regWaitNotify(ShmRegistry *reg, uint32_t seen, int timeout_ms)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, &reg->notify, FUTEX_WAIT, seen, &ts, nullptr, 0);
+    return __atomic_load_n(&reg->notify, __ATOMIC_SEQ_CST);
+}
+
+// Active uids in slot order, re-read only when the generation moves.
+const vector<string> &regMembers(ShmRegistry *reg)
+{
+    static vector<string> members;
+    static uint32_t seen = 0;
+    static bool valid = false;
+    uint32_t gen = __atomic_load_n(&reg->generation, __ATOMIC_SEQ_CST);
+    if (valid && gen == seen)
+        return members;
+    members.clear();
+    for (size_t i = 0; i < MAX_USERS; ++i)
+    {
+        if (__atomic_load_n(&reg->users[i].active, __ATOMIC_SEQ_CST) == 1 && reg->users[i].uid[0])
+            members.emplace_back(reg->users[i].uid);
+    }
+    seen = gen;
+    valid = true;
+    return members;
+}
+
 // register user (lock-free). returns slot index or -1
 int regUser(ShmRegistry *reg, const string &uid)
 {
@@ -153,10 +490,15 @@ int regUser(ShmRegistry *reg, const string &uid)
         if (strncmp(reg->users[i].uid, uid.c_str(), uid_LEN) == 0)
         {
             int prev = __atomic_load_n(&reg->users[i].active, __ATOMIC_SEQ_CST);
-            if (prev == 1)
-                return int(i);
-            if (atomicCASActive(&reg->users[i].active, 0, 1))
+            if (prev == 1 || atomicCASActive(&reg->users[i].active, 0, 1))
+            {
+                reg->users[i].numRanges = 0;
+                reg->users[i].relayFanout = 0;
+                reg->users[i].numShared = 0;
+                __atomic_add_fetch(&reg->users[i].epoch, 1, __ATOMIC_SEQ_CST);
+                regBumpGeneration(reg);
                 return int(i);
+            }
         }
     }
     // claim free slot
@@ -173,7 +515,12 @@ int regUser(ShmRegistry *reg, const string &uid)
             string qn = string("/mq_") + uid;
             memset(reg->users[i].qName, 0, NAME_QLEN);
             strncpy(reg->users[i].qName, qn.c_str(), NAME_QLEN - 1);
+            reg->users[i].numRanges = 0;
+            reg->users[i].relayFanout = 0;
+            reg->users[i].numShared = 0;
             reg->numUsers = min<int>(MAX_USERS, reg->numUsers + 1);
+            __atomic_add_fetch(&reg->users[i].epoch, 1, __ATOMIC_SEQ_CST);
+            regBumpGeneration(reg);
             return int(i);
         }
     }
@@ -187,4 +534,57 @@ void deregSlot(ShmRegistry *reg, int slot)
     reg->users[slot].uid[0] = '\0';
     reg->users[slot].qName[0] = '\0';
     reg->numUsers = max(0, reg->numUsers - 1);
-}
\ No newline at end of file
+    regBumpGeneration(reg);
+}
+// Wipe a registry nobody is using (stale contents from crashed processes).
+void resetRegIfIdle(ShmRegistry *reg)
+{
+    for (size_t i = 0; i < MAX_USERS; ++i)
+    {
+        if (reg->users[i].active != 0)
+            return;
+    }
+    if (__atomic_load_n(&reg->brokerActive, __ATOMIC_SEQ_CST) == 1 && kill(reg->brokerPid, 0) == 0)
+        return;
+    uint32_t gen = __atomic_load_n(&reg->generation, __ATOMIC_SEQ_CST);
+    uint32_t notify = __atomic_load_n(&reg->notify, __ATOMIC_SEQ_CST);
+    memset(reg, 0, sizeof(ShmRegistry));
+    reg->numUsers = 0;
+    reg->generation = gen; // keep both monotonic for anyone caching them
+    reg->notify = notify;
+    regBumpGeneration(reg);
+}
+
+// BROKER slot in the registry
+bool claimBroker(ShmRegistry *reg, const string &qName)
+{
+    if (!atomicCASActive(&reg->brokerActive, 0, 1))
+    {
+        // a crashed broker leaves its flag behind; take over only if it is gone
+        if (kill(reg->brokerPid, 0) == 0 || errno != ESRCH)
+            return false;
+    }
+    reg->brokerPid = getpid();
+    memset(reg->brokerQName, 0, NAME_QLEN);
+    strncpy(reg->brokerQName, qName.c_str(), NAME_QLEN - 1);
+    regBumpGeneration(reg);
+    return true;
+}
+void releaseBroker(ShmRegistry *reg)
+{
+    if (reg->brokerPid != getpid())
+        return;
+    reg->brokerQName[0] = '\0';
+    reg->brokerPid = 0;
+    __atomic_store_n(&reg->brokerActive, 0, __ATOMIC_SEQ_CST);
+    regBumpGeneration(reg);
+}
+// Queue name of a running broker, or "" when peers must fan out themselves.
+string liveBrokerQ(ShmRegistry *reg)
+{
+    if (__atomic_load_n(&reg->brokerActive, __ATOMIC_SEQ_CST) != 1 || !reg->brokerQName[0])
+        return string();
+    if (kill(reg->brokerPid, 0) != 0 && errno == ESRCH)
+        return string();
+    return string(reg->brokerQName);
+}
@@ -11,4 +11,6 @@
 #include <mqueue.h>
 #include <thread>
 #include <chrono>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 using namespace std;
\ No newline at end of file
@@ -0,0 +1,371 @@
+#include "headers.cpp"
+#include "replay.cpp"
+#include "synctext.h"
+
+// LIBRARY API (synctext.h)
+// Wraps the replica the control client used to drive from main(). gApiMu
+// serialises API calls against the step body; it is recursive so a
+// remote-change callback may call back into the API.
+static recursive_mutex gApiMu;
+static bool gStarted = false;
+static bool gWatchFiles = true;
+static bool gTerminalUi = false;
+static bool gShareDocs = false;
+static bool gStreamMerge = false;
+static uint32_t gShownGen = 0;
+static bool gRedrawPending = false; // render ring was full
+static thread gListener, gWatcher;
+
+static Document *apiDoc(const string &docId)
+{
+    auto it = gDocs.find(docId);
+    return it == gDocs.end() ? nullptr : &it->second;
+}
+
+static void apiShow(Document &d)
+{
+    if (!gTerminalUi)
+        return;
+    focusDocument(d);
+    gRedrawPending = !gRender.post(renderSnapshot(d));
+}
+
+bool stValidDocId(const string &id)
+{
+    return validDocId(id);
+}
+
+bool stStart(const StConfig &cfg)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    if (gStarted)
+    {
+        std::cerr << "[" << gUID << "] Replica already running\n";
+        return false;
+    }
+    if (cfg.uid.empty() || cfg.uid.size() >= uid_LEN)
+    {
+        std::cerr << "uid too long\n";
+        return false;
+    }
+    vector<string> doc_ids = cfg.docs;
+    if (doc_ids.empty())
+        doc_ids.push_back(DEFAULT_DOC_ID);
+    for (const string &id : doc_ids)
+    {
+        if (!validDocId(id))
+        {
+            std::cerr << "invalid doc id: " << id << "\n";
+            return false;
+        }
+    }
+    Transport *self = transportByName(cfg.transport);
+    if (!self)
+    {
+        std::cerr << "unknown transport: " << cfg.transport << "\n";
+        return false;
+    }
+
+    gUID = cfg.uid;
+    gRelayFanout = (uint32_t)max(0, cfg.relayFanout);
+    gWatchFiles = cfg.watchFiles;
+    gTerminalUi = cfg.terminalUi;
+    gShareDocs = cfg.shared;
+    gStreamMerge = cfg.streamMerge;
+
+    ShmRegistry *reg = openReg();
+    if (!reg)
+    {
+        std::cerr << "Failed to open shared registry\n";
+        return false;
+    }
+    gReg = reg;
+
+    resetRegIfIdle(reg);
+
+    int slot = regUser(reg, gUID);
+    if (slot == -1)
+    {
+        std::cerr << "[" << gUID << "] Registry full\n";
+        releaseReplica();
+        return false;
+    }
+    gMySlot = slot;
+
+    size_t sys_max = maxSysMsgSize();
+    gMQ_msgsize = (sys_max > 0) ? std::min<size_t>(sys_max, 8192) : 8192;
+
+    gTransport = self;
+    if (!gTransport->openSelf(gUID, gQName))
+    {
+        std::cerr << "[" << gUID << "] Failed to open " << self->name() << " endpoint\n";
+        releaseReplica();
+        gTransport = nullptr;
+        return false;
+    }
+
+    std::strncpy(reg->users[slot].qName, gQName.c_str(), NAME_QLEN - 1);
+    reg->users[slot].relayFanout = gRelayFanout;
+    regBumpGeneration(reg);
+    std::cerr << "[" << gUID << "] Registered slot " << slot << ", endpoint " << gQName << "\n";
+
+    if (!cfg.tracePath.empty() && !traceOpen(cfg.tracePath))
+    {
+        releaseReplica();
+        gTransport = nullptr;
+        return false;
+    }
+    for (const string &id : doc_ids)
+    {
+        openDocument(id);
+        if (gShareDocs)
+            shareDocument(gDocs[id], reg);
+    }
+
+    gExit.store(false);
+    if (!gSender.start())
+    {
+        releaseReplica();
+        gTransport = nullptr;
+        return false;
+    }
+    gDecode.start();
+    gPersist.start();
+    if (gTerminalUi)
+    {
+        gRender.start();
+        apiShow(gDocs.begin()->second);
+    }
+    gListener = thread(listenerThreadFunc);
+    gWatcher = thread(registryWatcherFunc, reg);
+    helloBroker(reg);
+    gShownGen = __atomic_load_n(&reg->generation, __ATOMIC_SEQ_CST);
+    gStarted = true;
+    return true;
+}
+
+bool stOpenDocument(const string &docId)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    if (!gStarted || !validDocId(docId))
+        return false;
+    if (!apiDoc(docId))
+    {
+        openDocument(docId);
+        if (gShareDocs)
+            shareDocument(gDocs[docId], gReg);
+    }
+    return true;
+}
+
+bool stInsert(const string &docId, int line, int col, const string &text)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    Document *d = apiDoc(docId);
+    if (!d || line < 0 || col < 0 || text.empty() || text.find('\n') != string::npos)
+        return false;
+    int len = (size_t)line < d->observed.size() ? (int)d->observed[line].size() : 0;
+    if (col > len)
+        return false;
+
+    Update u;
+    u.op = Op::Insert;
+    u.lineNum = line;
+    u.startCol = col;
+    u.endCol = col;
+    u.newContent = text;
+    followEdits(*d, {u}, gReg);
+    submitLocalUpdate(*d, u);
+    wakeMainLoop();
+    return true;
+}
+
+bool stDelete(const string &docId, int line, int startCol, int endCol)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    Document *d = apiDoc(docId);
+    if (!d || line < 0 || (size_t)line >= d->observed.size())
+        return false;
+    const string &cur = d->observed[line];
+    if (startCol < 0 || endCol <= startCol || (size_t)endCol > cur.size())
+        return false;
+
+    Update u;
+    u.op = Op::Delete;
+    u.lineNum = line;
+    u.startCol = startCol;
+    u.endCol = endCol;
+    u.prevContent = string_view(cur).substr(startCol, endCol - startCol);
+    followEdits(*d, {u}, gReg);
+    submitLocalUpdate(*d, u); // copies prevContent before the line changes
+    wakeMainLoop();
+    return true;
+}
+
+bool stLines(const string &docId, vector<string> &out)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    Document *d = apiDoc(docId);
+    if (!d)
+        return false;
+    out = d->observed;
+    return true;
+}
+
+bool stFollowLines(const string &docId, int lo, int hi)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    Document *d = apiDoc(docId);
+    if (!d || lo < 0 || hi <= lo)
+        return false;
+    followLines(*d, lo, hi, gReg);
+    return true;
+}
+
+bool stFollowAll(const string &docId)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    Document *d = apiDoc(docId);
+    if (!d)
+        return false;
+    followWholeDocument(*d, gReg);
+    return true;
+}
+
+void stOnRemoteChange(StChangeCallback cb)
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    if (!cb)
+    {
+        gRemoteApplied = nullptr;
+        return;
+    }
+    gRemoteApplied = [cb](const Document &d, const Update &u)
+    {
+        StChange c;
+        c.docId = d.id;
+        c.site = gSites.name(u.site);
+        c.op = opName(u.op)[0];
+        c.line = u.lineNum;
+        c.startCol = u.startCol;
+        c.endCol = u.endCol;
+        c.oldText = string(u.prevContent);
+        c.newText = string(u.newContent);
+        cb(c);
+    };
+}
+
+static void apiStep(bool force)
+{
+    ShmRegistry *reg = gReg;
+
+    // membership changed: refresh the active user list right away
+    uint32_t gen = __atomic_load_n(&reg->generation, __ATOMIC_SEQ_CST);
+    if (gen != gShownGen || gRedrawPending)
+    {
+        gShownGen = gen;
+        if (gFocusDoc)
+            apiShow(*gFocusDoc);
+    }
+
+    serveLineRequests(reg);
+    relayForward(reg);
+
+    for (auto &kv : gDocs)
+    {
+        Document &d = kv.second;
+        if (gWatchFiles && pollDocument(d))
+        {
+            followEdits(d, d.prevEdits, reg);
+            apiShow(d);
+        }
+        shareLocalEdits(d);
+        if (reloadShared(d))
+            apiShow(d);
+        postPersist(d);
+        broadcastDocument(d, reg, force);
+    }
+
+    routeIncoming();
+    sendAcks(reg);
+
+    for (auto &kv : gDocs)
+    {
+        Document &d = kv.second;
+        if (mergeDocument(d, force || gStreamMerge))
+            apiShow(d);
+    }
+    deliverRemoteChanges();
+}
+
+void stStep(int timeoutMs)
+{
+    waitMainLoop(timeoutMs);
+    lock_guard<recursive_mutex> lk(gApiMu);
+    if (gStarted && !gExit.load())
+        apiStep(false);
+}
+
+void stFlush()
+{
+    lock_guard<recursive_mutex> lk(gApiMu);
+    if (gStarted)
+        apiStep(true);
+}
+
+int stRun()
+{
+    while (gStarted && !gExit.load())
+        stStep(POLL_INTERVAL_SEC * 1000);
+    stShutdown();
+    return 0;
+}
+
+void stStop()
+{
+    gExit.store(true);
+}
+
+void stShutdown()
+{
+    gExit.store(true);
+    wakeMainLoop();
+    if (gListener.joinable())
+        gListener.join();
+    if (gWatcher.joinable())
+        gWatcher.join();
+    gDecode.stop();
+
+    lock_guard<recursive_mutex> lk(gApiMu);
+    if (!gStarted)
+        return;
+    gSender.stop(); // last attempt at queued frames before the endpoint closes
+    gRender.stop();
+    gPersist.stop(); // merged state reaches the files before we leave
+    for (auto &kv : gDocs)
+    {
+        postPersist(kv.second); // inline now
+        snapshotOnExit(kv.second);
+    }
+    gStarted = false;
+    traceClose();
+    unshareAll();
+    releaseReplica();
+    gTransport = nullptr;
+    gMySlot = -1;
+}
+
+int stRunBroker()
+{
+    return runBroker();
+}
+
+int stRunBench(size_t lines, size_t maxThreads)
+{
+    return runBench(lines, maxThreads);
+}
+
+int stRunReplay(const string &tracePath, bool realtime, bool raw)
+{
+    return runReplay(tracePath, realtime, raw);
+}
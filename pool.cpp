@@ -0,0 +1,153 @@
+#include "headers.cpp"
+#include "globals.cpp"
+#include <condition_variable>
+
+// WORK POOL (work stealing)
+// Each thread owns a deque: it pops its own work from the back while idle
+// threads steal from the front of the others. The thread calling
+// parallelFor() owns queue 0 and helps until its chunks are done, so a pool
+// of size 1 simply runs everything inline. The default pool is only created
+// the first time a large diff/merge/apply needs it.
+const size_t PAR_DIFF_MIN_LINES = 1 << 15;
+const size_t PAR_DIFF_GRAIN = 1 << 14;    // lines per diff chunk
+const size_t PAR_MERGE_MIN_UPDATES = 4096;
+const size_t PAR_APPLY_MIN_LINES = 1024;  // touched lines
+
+class WorkPool
+{
+    struct Queue
+    {
+        mutex mu;
+        deque<function<void()>> tasks;
+    };
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> threads;
+    atomic<bool> stop{false};
+    atomic<size_t> queued{0};
+    mutex idleMu;
+    condition_variable idleCv;
+
+    bool popOwn(size_t w, function<void()> &task)
+    {
+        Queue &q = *queues[w];
+        lock_guard<mutex> lk(q.mu);
+        if (q.tasks.empty())
+            return false;
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+    bool steal(size_t w, function<void()> &task)
+    {
+        for (size_t k = 1; k < queues.size(); ++k)
+        {
+            Queue &q = *queues[(w + k) % queues.size()];
+            lock_guard<mutex> lk(q.mu);
+            if (q.tasks.empty())
+                continue;
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+    bool next(size_t w, function<void()> &task)
+    {
+        if (!popOwn(w, task) && !steal(w, task))
+            return false;
+        queued.fetch_sub(1);
+        return true;
+    }
+    void workerLoop(size_t w)
+    {
+        function<void()> task;
+        while (!stop.load())
+        {
+            if (next(w, task))
+            {
+                task();
+                continue;
+            }
+            unique_lock<mutex> lk(idleMu);
+            idleCv.wait(lk, [&] { return stop.load() || queued.load() > 0; });
+        }
+    }
+
+public:
+    explicit WorkPool(size_t n)
+    {
+        n = max<size_t>(1, n);
+        for (size_t i = 0; i < n; ++i)
+            queues.emplace_back(new Queue);
+        for (size_t i = 1; i < n; ++i)
+            threads.emplace_back(&WorkPool::workerLoop, this, i);
+    }
+    ~WorkPool()
+    {
+        {
+            lock_guard<mutex> lk(idleMu);
+            stop.store(true);
+        }
+        idleCv.notify_all();
+        for (auto &t : threads)
+            t.join();
+    }
+    size_t size() const { return queues.size(); }
+
+    // Run body(lo, hi) over [0, n) in chunks of `grain`; returns once all ran.
+    void parallelFor(size_t n, size_t grain, const function<void(size_t, size_t)> &body)
+    {
+        grain = max<size_t>(1, grain);
+        if (threads.empty() || n <= grain)
+        {
+            if (n)
+                body(0, n);
+            return;
+        }
+        size_t chunks = (n + grain - 1) / grain;
+        atomic<size_t> left{chunks};
+        // counted before any task is visible, so a worker's decrement for a
+        // task it took can never run ahead of the increment
+        {
+            lock_guard<mutex> lk(idleMu);
+            queued.fetch_add(chunks);
+        }
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            size_t lo = c * grain, hi = min(n, lo + grain);
+            Queue &q = *queues[c % queues.size()];
+            lock_guard<mutex> lk(q.mu);
+            q.tasks.emplace_back([&body, &left, lo, hi] {
+                body(lo, hi);
+                left.fetch_sub(1);
+            });
+        }
+        idleCv.notify_all();
+
+        function<void()> task;
+        while (left.load() > 0)
+        {
+            if (next(0, task))
+                task();
+            else
+                this_thread::yield();
+        }
+    }
+};
+
+static WorkPool *gPoolOverride = nullptr; // lets the benchmark swap pool sizes
+
+size_t defaultPoolSize()
+{
+    const char *env = getenv("SYNCTEXT_THREADS");
+    if (env && atoi(env) > 0)
+        return (size_t)atoi(env);
+    return max(1u, thread::hardware_concurrency());
+}
+WorkPool &workPool()
+{
+    if (gPoolOverride)
+        return *gPoolOverride;
+    static WorkPool pool(defaultPoolSize());
+    return pool;
+}
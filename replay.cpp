@@ -0,0 +1,284 @@
+#include "headers.cpp"
+#include "bench.cpp"
+
+// TRACE REPLAY (control --replay <trace> [--realtime])
+// Feeds a recorded trace (trace.cpp) through the replica's engine: local and
+// received updates join the pending batch of their document exactly as they
+// entered the recorder's merges, and each TRACE_MERGE runs crdtMerge, the
+// winner index and applyLineUpdates on that document. Runs as fast as
+// possible unless `realtime`, then reports throughput and the final hash of
+// every document so engine changes can be compared on the same workload.
+// Shared documents take their text from each recorded reload, but their
+// merges are judged without the stamps other group members left in the
+// segment, so only private documents are reproduced merge for merge.
+// With `raw` the received updates come from the recorded frames instead
+// (TRACE_RAW), through the receive path: link headers, relay duplicates,
+// reassembly, decompression and the stale filter. They join a batch as
+// they were received rather than where they entered a merge, so the result
+// can differ from the exact replay when frames arrived close to a merge.
+struct ReplayStats
+{
+    size_t records = 0, received = 0, bytes = 0, updates = 0, merges = 0, applied = 0, skipped = 0;
+    size_t frames = 0, duplicates = 0, stale = 0;
+};
+
+static uint64_t replayDigest(const vector<uint64_t> &hashes)
+{
+    uint64_t h = hashes.size();
+    for (uint64_t x : hashes)
+        h = h * 31 + x;
+    return h;
+}
+
+static Document *replayDoc(map<string, Document> &docs, const string &id)
+{
+    auto it = docs.find(id);
+    return it == docs.end() ? nullptr : &it->second;
+}
+
+// "doc_id\0" then lines ending in '\n' (TRACE_OPEN, TRACE_RELOAD).
+static bool replayLines(const string &payload, string &id, vector<string> &lines)
+{
+    size_t z = payload.find('\0');
+    if (z == string::npos)
+        return false;
+    id = payload.substr(0, z);
+    lines.clear();
+    for (size_t pos = z + 1, nl; (nl = payload.find('\n', pos)) != string::npos; pos = nl + 1)
+        lines.push_back(payload.substr(pos, nl - pos));
+    return true;
+}
+
+// Spans recorded outside a merge (TRACE_WINNERS).
+static bool replayWinners(map<string, Document> &docs, const string &payload)
+{
+    vector<Update> spans;
+    if (!stampsDeserialize(payload, spans) || spans.empty())
+        return false;
+    Document *d = replayDoc(docs, gDocIds.name(spans[0].doc));
+    if (!d)
+        return false;
+    lwwAdmitSpans(d->winners, spans);
+    return true;
+}
+
+// Deserialize one wire record (one update or a block) into the pending
+// batch of its document.
+static bool replayQueue(map<string, Document> &docs, const string &rec, bool local, ReplayStats &st)
+{
+    vector<Update> recs;
+    if (!updatesDeserialize(rec, recs, nullptr))
+        return false;
+    Document *d = replayDoc(docs, gDocIds.name(recs[0].doc));
+    if (!d)
+        return false;
+    for (Update &u : recs)
+    {
+        u.prevContent = d->arena.copy(u.prevContent);
+        u.newContent = d->arena.copy(u.newContent);
+        (local ? d->localUnmerged : d->recvUnmerged).push_back(u);
+        st.updates++;
+    }
+    return true;
+}
+
+static void replayMerge(Document &d, ReplayStats &st)
+{
+    vector<Update> all;
+    all.reserve(d.localUnmerged.size() + d.recvUnmerged.size());
+    all.insert(all.end(), d.localUnmerged.begin(), d.localUnmerged.end());
+    all.insert(all.end(), d.recvUnmerged.begin(), d.recvUnmerged.end());
+    vector<Update>().swap(d.localUnmerged);
+    vector<Update>().swap(d.recvUnmerged);
+    d.recvPending.clear();
+    if (all.empty())
+        return;
+    vector<Update> winners = lwwAdmit(d.winners, crdtMerge(all));
+    applyLineUpdates(d.lines, winners, &d.linesHash);
+    d.arena.reset();
+    st.merges++;
+    st.applied += winners.size();
+}
+
+// A record decoded from a frame joins its document's batch the way
+// routeIncoming takes it: a line its site already has pending is merged
+// first, and updates the winner index already beats are dropped.
+static bool replayReceive(map<string, Document> &docs, const string &rec, ReplayStats &st)
+{
+    if (isStampsRecord(rec))
+        return replayWinners(docs, rec);
+    vector<Update> recs;
+    if (!updatesDeserialize(rec, recs, nullptr))
+        return false;
+    Document *d = replayDoc(docs, gDocIds.name(recs[0].doc));
+    if (!d)
+        return false;
+    st.received++;
+    for (const Update &u : recs)
+    {
+        if (d->recvPending.count({u.site, u.lineNum}))
+        {
+            replayMerge(*d, st);
+            break;
+        }
+    }
+    for (Update &u : recs)
+    {
+        if (lwwStale(d->winners, u))
+        {
+            st.stale++;
+            continue;
+        }
+        u.prevContent = d->arena.copy(u.prevContent);
+        u.newContent = d->arena.copy(u.newContent);
+        d->recvUnmerged.push_back(u);
+        d->recvPending.insert({u.site, u.lineNum});
+        st.updates++;
+    }
+    return true;
+}
+
+// One message as the listener received it (TRACE_RAW): sequenced ones are
+// taken in order and once, relayed frames once, then decoded into records.
+static void replayFrame(map<string, Document> &docs, string msg, bool relay, ReplayStats &st)
+{
+    st.frames++;
+    if (msg.compare(0, 2, "A|") == 0)
+        return;
+    LinkHeader link;
+    vector<string> ready;
+    if (linkUnwrap(msg, link))
+        linkAccept(link, std::move(msg), ready);
+    else
+        ready.push_back(std::move(msg));
+    if (ready.empty())
+        st.duplicates++;
+    for (const string &m : ready)
+    {
+        if (m.compare(0, 2, "R|") == 0)
+            continue;
+        if (relay && m.compare(0, 2, "F|") == 0)
+        {
+            if (wireRelaySeen(m))
+            {
+                st.duplicates++;
+                continue;
+            }
+            wireRelayRemember(m);
+        }
+        vector<string> records;
+        if (!wireAccept(m, records))
+        {
+            st.skipped++;
+            continue;
+        }
+        for (const string &rec : records)
+        {
+            if (!replayReceive(docs, rec, st))
+                st.skipped++;
+        }
+    }
+}
+
+int runReplay(const string &path, bool realtime, bool raw)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        perror(path.c_str());
+        return 1;
+    }
+    TraceHeader hdr;
+    if (!traceReadHeader(f, hdr))
+    {
+        std::cerr << path << ": not a synctext trace\n";
+        fclose(f);
+        return 1;
+    }
+    gUID = hdr.uid; // local updates carry the recorder's site
+
+    map<string, Document> docs;
+    ReplayStats st;
+    TraceRecord r;
+    uint64_t lastNs = 0;
+    chrono::steady_clock::duration busy{};
+    auto begin = chrono::steady_clock::now();
+    while (traceReadRecord(f, r))
+    {
+        if (realtime)
+            this_thread::sleep_until(begin + chrono::nanoseconds(r.ns));
+        auto t0 = chrono::steady_clock::now();
+        st.records++;
+        st.bytes += r.payload.size();
+        lastNs = r.ns;
+
+        switch (r.kind)
+        {
+        case TRACE_OPEN:
+        case TRACE_RELOAD:
+        {
+            string id;
+            vector<string> lines;
+            if (!replayLines(r.payload, id, lines) || (r.kind == TRACE_RELOAD && !replayDoc(docs, id)))
+            {
+                st.skipped++;
+                break;
+            }
+            Document &d = docs[id];
+            d.id = id;
+            d.lines.swap(lines);
+            d.linesHash = hashLines(d.lines);
+            if (r.kind == TRACE_OPEN)
+                d.winners.clear();
+            break;
+        }
+        case TRACE_WINNERS:
+            if (!replayWinners(docs, r.payload))
+                st.skipped++;
+            break;
+        case TRACE_RECV:
+            if (raw)
+                break;
+            st.received++;
+            if (!replayQueue(docs, r.payload, false, st))
+                st.skipped++;
+            break;
+        case TRACE_RAW:
+            if (raw)
+                replayFrame(docs, std::move(r.payload), hdr.relayK > 0, st);
+            break;
+        case TRACE_LOCAL:
+            if (!replayQueue(docs, r.payload, true, st))
+                st.skipped++;
+            break;
+        case TRACE_MERGE:
+            if (Document *d = replayDoc(docs, r.payload))
+                replayMerge(*d, st);
+            break;
+        default:
+            st.skipped++;
+        }
+        busy += chrono::steady_clock::now() - t0;
+    }
+    fclose(f);
+
+    // whatever arrived after the recorder's last merge
+    auto t0 = chrono::steady_clock::now();
+    for (auto &kv : docs)
+        replayMerge(kv.second, st);
+    busy += chrono::steady_clock::now() - t0;
+
+    double busyMs = chrono::duration<double, milli>(busy).count();
+    double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    printf("trace %s: uid=%s records=%zu received=%zu bytes=%zu recorded span=%.2f s\n", path.c_str(),
+           hdr.uid.c_str(), st.records, st.received, st.bytes, lastNs / 1e9);
+    if (raw)
+        printf("frames=%zu duplicates=%zu stale=%zu\n", st.frames, st.duplicates, st.stale);
+    printf("updates=%zu merges=%zu applied=%zu skipped=%zu\n", st.updates, st.merges, st.applied, st.skipped);
+    printf("engine %.2f ms (wall %.2f ms): %.0f updates/s, %.2f MB/s\n", busyMs, wallMs,
+           busyMs > 0 ? st.updates / (busyMs / 1000) : 0.0, busyMs > 0 ? st.bytes / (busyMs * 1000) : 0.0);
+    for (const auto &kv : docs)
+        printf("doc %-16s lines=%zu hash=%016llx\n", kv.first.c_str(), kv.second.lines.size(),
+               (unsigned long long)replayDigest(kv.second.linesHash));
+    return 0;
+}
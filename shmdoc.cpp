@@ -0,0 +1,499 @@
+#include "headers.cpp"
+#include "crdtUtils.cpp"
+
+// SHARED DOCUMENTS (control <uid> --shared)
+// Peers on this host can keep a document's canonical state in one /dev/shm
+// segment instead of a replica each. They write their own edits straight into
+// it under a writer lock, read it under a seqlock and are woken through the
+// registry notify futex, so no message crosses between group members. Only
+// the group leader (lowest slot) takes updates from peers outside the group,
+// so nothing is applied twice; members send their own edits to outside peers.
+//
+// Every write also leaves the LWW stamps of what it wrote in a ring, and a
+// writer records the others' stamps in its winner index before admitting its
+// own updates, so received updates are judged against edits any member
+// wrote, not just its own.
+//
+// A writer that dies inside leaves the lock to whoever finds its pid gone.
+// Its table and heap may be half written, so the taker lays the document out
+// again from its own merged copy before readers see an even seq. Members are
+// recorded by pid, and the ones that died are reaped on every attach and
+// detach, so the last live process still removes the segment.
+//
+// Segment layout; every reference is an offset from the segment start, so
+// each process can map it anywhere and remap it when it grows:
+//   ShmDocHeader | ShmStamp[SHM_DOC_STAMPS] | ShmLine[lineCap] | string heap
+const uint32_t SHM_DOC_MAGIC = 0x53594e47; // "SYNG"
+const size_t SHM_DOC_MIN_HEAP = 1 << 16;
+const size_t SHM_DOC_MIN_LINES = 1024;
+const size_t SHM_DOC_STAMPS = 4096;
+const unsigned SHM_DOC_CHECK_SPINS = 1024; // reader yields between writer liveness checks
+const size_t SHM_DOC_MEMBERS = 64;         // processes mapping one segment at a time
+
+struct ShmLine
+{
+    uint64_t off;
+    uint32_t len;
+    uint32_t pad;
+};
+struct ShmDocHeader
+{
+    uint32_t magic;    // set last by the creator, cleared before unlinking
+    uint32_t seq;      // seqlock: odd while a writer is inside
+    int32_t writer;    // pid holding the writer lock, 0 = free
+    uint32_t pad;
+    uint64_t capacity; // bytes of the whole segment; only grows
+    uint64_t tableOff;
+    uint64_t heapOff;
+    uint64_t heapUsed; // next free byte
+    uint32_t numLines;
+    uint32_t lineCap;
+    uint64_t stamps; // ShmStamps ever written; entry k sits at k % SHM_DOC_STAMPS
+    int32_t members[SHM_DOC_MEMBERS]; // pids mapping the segment, 0 = free
+};
+struct ShmStamp
+{
+    int32_t line, start, end;
+    int32_t len; // new text length of the update; -1 for a span recorded as is
+    int64_t timestamp;
+    char uid[uid_LEN];
+};
+struct ShmDoc
+{
+    string name;
+    int fd = -1;
+    char *base = nullptr;
+    size_t mapped = 0;
+    const vector<string> *merged = nullptr; // this process's copy, to repair a torn segment
+    ShmDocHeader *hdr() const { return reinterpret_cast<ShmDocHeader *>(base); }
+    ShmStamp *stamps() const { return reinterpret_cast<ShmStamp *>(base + stampsOff()); }
+    static size_t stampsOff() { return (sizeof(ShmDocHeader) + 7) & ~size_t(7); }
+};
+
+static bool shmDocRemap(ShmDoc &sd)
+{
+    size_t cap = sd.base ? (size_t)__atomic_load_n(&sd.hdr()->capacity, __ATOMIC_ACQUIRE) : sizeof(ShmDocHeader);
+    if (sd.base && cap <= sd.mapped)
+        return true;
+    if (sd.base)
+        munmap(sd.base, sd.mapped);
+    void *p = mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_SHARED, sd.fd, 0);
+    if (p == MAP_FAILED)
+    {
+        perror(("mmap " + sd.name).c_str());
+        sd.base = nullptr;
+        sd.mapped = 0;
+        return false;
+    }
+    sd.base = static_cast<char *>(p);
+    sd.mapped = cap;
+    return true;
+}
+
+// A writer that died inside leaves its pid behind.
+static bool shmDocWriterGone(int32_t pid)
+{
+    return pid > 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+static bool shmDocRebuild(ShmDoc &sd, const vector<string> &lines);
+
+// The writer died with seq odd: lay the document out again from our merged
+// copy, then let readers in. Writer lock held.
+static void shmDocRepair(ShmDoc &sd)
+{
+    cerr << "[" << gUID << "] WARN: writer of " << sd.name << " died mid-write, rebuilding it from our copy\n";
+    if (!sd.merged || !shmDocRebuild(sd, *sd.merged))
+        cerr << "[" << gUID << "] WARN: could not rebuild " << sd.name << ", its lines may be torn\n";
+    __atomic_add_fetch(&sd.hdr()->seq, 1, __ATOMIC_RELEASE);
+}
+
+static void shmDocLock(ShmDoc &sd)
+{
+    int32_t me = (int32_t)getpid();
+    bool torn = false;
+    for (;;)
+    {
+        int32_t holder = 0;
+        if (__atomic_compare_exchange_n(&sd.hdr()->writer, &holder, me, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        if (shmDocWriterGone(holder) &&
+            __atomic_compare_exchange_n(&sd.hdr()->writer, &holder, me, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            torn = __atomic_load_n(&sd.hdr()->seq, __ATOMIC_RELAXED) & 1;
+            break;
+        }
+        sched_yield();
+    }
+    shmDocRemap(sd); // another writer may have grown it
+    if (torn)
+        shmDocRepair(sd);
+}
+
+// Drop members that died without detaching; the live ones left. Writer lock
+// held.
+static size_t shmDocReap(ShmDoc &sd)
+{
+    size_t live = 0;
+    for (int32_t &pid : sd.hdr()->members)
+    {
+        if (pid && shmDocWriterGone(pid))
+            pid = 0;
+        live += pid != 0;
+    }
+    return live;
+}
+
+// Record us as a member; false when every slot is held by a live process.
+// Writer lock held.
+static bool shmDocJoin(ShmDoc &sd)
+{
+    shmDocReap(sd);
+    for (int32_t &pid : sd.hdr()->members)
+    {
+        if (!pid)
+        {
+            pid = (int32_t)getpid();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void shmDocUnlock(ShmDoc &sd)
+{
+    __atomic_store_n(&sd.hdr()->writer, 0, __ATOMIC_RELEASE);
+}
+
+// Lay the whole document out afresh, growing the segment if needed. Writer
+// lock held and seq odd, so readers retry until it is done.
+static bool shmDocRebuild(ShmDoc &sd, const vector<string> &lines)
+{
+    size_t bytes = 0;
+    for (const auto &l : lines)
+        bytes += l.size();
+    size_t lineCap = max(SHM_DOC_MIN_LINES, lines.size() * 2);
+    size_t tableOff = ShmDoc::stampsOff() + SHM_DOC_STAMPS * sizeof(ShmStamp);
+    size_t heapOff = tableOff + lineCap * sizeof(ShmLine);
+    size_t need = heapOff + max(SHM_DOC_MIN_HEAP, bytes * 2);
+
+    ShmDocHeader *h = sd.hdr();
+    if (need > h->capacity)
+    {
+        size_t cap = max<size_t>(need, h->capacity * 2);
+        if (ftruncate(sd.fd, (off_t)cap) == -1)
+        {
+            perror(("ftruncate " + sd.name).c_str());
+            return false;
+        }
+        __atomic_store_n(&h->capacity, (uint64_t)cap, __ATOMIC_RELEASE);
+        if (!shmDocRemap(sd))
+            return false;
+        h = sd.hdr();
+    }
+
+    ShmLine *table = reinterpret_cast<ShmLine *>(sd.base + tableOff);
+    size_t at = heapOff;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        memcpy(sd.base + at, lines[i].data(), lines[i].size());
+        table[i] = ShmLine{at, (uint32_t)lines[i].size(), 0};
+        at += lines[i].size();
+    }
+    h->tableOff = tableOff;
+    h->heapOff = heapOff;
+    h->heapUsed = at;
+    h->lineCap = (uint32_t)lineCap;
+    h->numLines = (uint32_t)lines.size();
+    return true;
+}
+
+// Consistent copy of the document; `seq` gets the version read. A reader
+// kept waiting on an odd seq checks the writer pid now and then: if it died
+// inside, taking its lock over rebuilds the document and makes seq even.
+bool shmDocRead(ShmDoc &sd, vector<string> &out, uint32_t &seq)
+{
+    for (unsigned spins = 1;; ++spins)
+    {
+        uint32_t s1 = __atomic_load_n(&sd.hdr()->seq, __ATOMIC_ACQUIRE);
+        if (s1 & 1)
+        {
+            if (spins % SHM_DOC_CHECK_SPINS == 0 &&
+                shmDocWriterGone(__atomic_load_n(&sd.hdr()->writer, __ATOMIC_RELAXED)))
+            {
+                shmDocLock(sd);
+                shmDocUnlock(sd);
+            }
+            sched_yield();
+            continue;
+        }
+        if (!shmDocRemap(sd))
+            return false;
+        const ShmDocHeader *h = sd.hdr();
+        size_t n = h->numLines, tableOff = h->tableOff;
+        bool ok = tableOff + n * sizeof(ShmLine) <= sd.mapped;
+        if (ok)
+            out.resize(n);
+        for (size_t i = 0; ok && i < n; ++i)
+        {
+            ShmLine l;
+            memcpy(&l, sd.base + tableOff + i * sizeof(ShmLine), sizeof(l));
+            ok = l.off + l.len <= sd.mapped;
+            if (ok)
+                out[i].assign(sd.base + l.off, l.len);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (ok && __atomic_load_n(&sd.hdr()->seq, __ATOMIC_RELAXED) == s1)
+        {
+            seq = s1;
+            return true;
+        }
+    }
+}
+
+uint32_t shmDocSeq(const ShmDoc &sd)
+{
+    return __atomic_load_n(&sd.hdr()->seq, __ATOMIC_ACQUIRE);
+}
+
+// Record in `idx` the stamps written since `cursor` (ours included, which
+// it already holds). Writer lock held.
+static void shmDocTakeStamps(ShmDoc &sd, WinnerIndex &idx, uint64_t &cursor)
+{
+    uint64_t head = sd.hdr()->stamps;
+    if (head - cursor > SHM_DOC_STAMPS)
+    {
+        if (cursor != 0)
+            cerr << "[" << gUID << "] WARN: " << (head - cursor - SHM_DOC_STAMPS) << " stamp(s) in " << sd.name
+                 << " overwritten before they were read\n";
+        cursor = head - SHM_DOC_STAMPS;
+    }
+    vector<Update> seen;
+    vector<int> lens;
+    seen.reserve(head - cursor);
+    for (; cursor < head; ++cursor)
+    {
+        const ShmStamp &st = sd.stamps()[cursor % SHM_DOC_STAMPS];
+        Update u;
+        u.lineNum = st.line;
+        u.startCol = st.start;
+        u.endCol = st.end;
+        u.timestamp = (time_t)st.timestamp;
+        u.site = gSites.id(string(st.uid, strnlen(st.uid, uid_LEN)));
+        seen.push_back(u);
+        lens.push_back(st.len);
+    }
+    lwwAdmit(idx, seen, &lens);
+}
+
+// Append the stamps of updates just written (or, with `spans`, of spans
+// recorded as they are). Writer lock held.
+static void shmDocPutStamps(ShmDoc &sd, const vector<Update> &wins, bool spans)
+{
+    ShmDocHeader *h = sd.hdr();
+    for (const auto &u : wins)
+    {
+        if (u.lineNum < 0)
+            continue;
+        ShmStamp st;
+        memset(&st, 0, sizeof(st));
+        st.line = u.lineNum;
+        st.start = u.startCol;
+        st.end = u.endCol;
+        st.len = spans ? -1 : (int32_t)u.newContent.size();
+        st.timestamp = (int64_t)u.timestamp;
+        strncpy(st.uid, gSites.name(u.site).c_str(), uid_LEN - 1);
+        sd.stamps()[h->stamps % SHM_DOC_STAMPS] = st;
+        h->stamps++;
+    }
+}
+
+// Record winner spans that came without a write (a catch-up copy's), for
+// every member of the group: those that pass admission are appended to the
+// stamps as if written.
+void shmDocRecordStamps(ShmDoc &sd, const vector<Update> &spans, WinnerIndex &idx, uint64_t &cursor)
+{
+    shmDocLock(sd);
+    shmDocTakeStamps(sd, idx, cursor);
+    shmDocPutStamps(sd, lwwAdmitSpans(idx, spans), true);
+    shmDocUnlock(sd);
+}
+
+// Apply updates to the canonical state. Under the writer lock the stamps
+// other writers left since `cursor` go into `idx` first, then `wins` is cut
+// down to the updates that pass LWW admission against it, the ones written.
+// Touched lines are appended to the heap in place; the document is only laid
+// out again when the heap or the line table runs out. `before`/`after` get
+// the versions around the write.
+bool shmDocWrite(ShmDoc &sd, vector<Update> &wins, WinnerIndex &idx, uint64_t &cursor, uint32_t &before,
+                 uint32_t &after)
+{
+    shmDocLock(sd);
+    shmDocTakeStamps(sd, idx, cursor);
+    wins = lwwAdmit(idx, wins);
+    map<int, size_t> slot; // line -> index into touched
+    for (const auto &u : wins)
+    {
+        if (u.lineNum >= 0)
+            slot.emplace(u.lineNum, 0);
+    }
+    before = after = __atomic_load_n(&sd.hdr()->seq, __ATOMIC_RELAXED);
+    if (slot.empty())
+    {
+        shmDocUnlock(sd);
+        return true;
+    }
+    __atomic_add_fetch(&sd.hdr()->seq, 1, __ATOMIC_ACQ_REL);
+
+    ShmDocHeader *h = sd.hdr();
+    auto lineAt = [&](size_t i) -> string
+    {
+        if (i >= h->numLines)
+            return string();
+        const ShmLine &l = reinterpret_cast<const ShmLine *>(sd.base + h->tableOff)[i];
+        return string(sd.base + l.off, l.len);
+    };
+
+    vector<string> touched;
+    for (auto &kv : slot)
+    {
+        kv.second = touched.size();
+        touched.push_back(lineAt((size_t)kv.first));
+    }
+    vector<Update> local(wins.begin(), wins.end());
+    for (auto &u : local)
+    {
+        if (u.lineNum >= 0)
+            u.lineNum = (int)slot[u.lineNum];
+    }
+    applyLineUpdates(touched, local);
+
+    size_t bytes = 0;
+    for (const auto &t : touched)
+        bytes += t.size();
+    size_t numLines = max<size_t>(h->numLines, (size_t)slot.rbegin()->first + 1);
+    bool ok = true;
+    if (numLines <= h->lineCap && h->heapUsed + bytes <= h->capacity)
+    {
+        ShmLine *table = reinterpret_cast<ShmLine *>(sd.base + h->tableOff);
+        for (size_t i = h->numLines; i < numLines; ++i)
+            table[i] = ShmLine{h->heapOff, 0, 0};
+        for (const auto &kv : slot)
+        {
+            const string &t = touched[kv.second];
+            memcpy(sd.base + h->heapUsed, t.data(), t.size());
+            table[kv.first] = ShmLine{h->heapUsed, (uint32_t)t.size(), 0};
+            h->heapUsed += t.size();
+        }
+        h->numLines = (uint32_t)numLines;
+    }
+    else
+    {
+        vector<string> all(numLines);
+        for (size_t i = 0; i < numLines; ++i)
+            all[i] = lineAt(i);
+        for (const auto &kv : slot)
+            all[kv.first].swap(touched[kv.second]);
+        ok = shmDocRebuild(sd, all);
+    }
+    if (ok)
+        shmDocPutStamps(sd, wins, false);
+
+    after = __atomic_add_fetch(&sd.hdr()->seq, 1, __ATOMIC_RELEASE);
+    shmDocUnlock(sd);
+    if (gReg)
+        regNotify(gReg);
+    return ok;
+}
+
+// Map the segment of `docId`, creating it from `initial` if nobody has yet.
+// `initial` is the caller's merged copy of the document; it must outlive the
+// mapping, which repairs the segment from it if a writer dies mid-write.
+ShmDoc *shmDocAttach(const string &docId, const vector<string> &initial)
+{
+    unique_ptr<ShmDoc> sd(new ShmDoc);
+    sd->name = SHARED_DOC_PREFIX + docId;
+    sd->merged = &initial;
+    for (int attempt = 0; attempt < 50; ++attempt)
+    {
+        sd->fd = shm_open(sd->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (sd->fd != -1)
+        {
+            if (ftruncate(sd->fd, sizeof(ShmDocHeader)) == -1 || !shmDocRemap(*sd))
+            {
+                shm_unlink(sd->name.c_str());
+                break;
+            }
+            ShmDocHeader *h = sd->hdr();
+            h->capacity = sizeof(ShmDocHeader);
+            h->writer = (int32_t)getpid();
+            h->seq = 1;
+            if (!shmDocRebuild(*sd, initial))
+            {
+                shm_unlink(sd->name.c_str());
+                break;
+            }
+            h = sd->hdr();
+            h->members[0] = (int32_t)getpid();
+            h->seq = 2;
+            h->writer = 0;
+            __atomic_store_n(&h->magic, SHM_DOC_MAGIC, __ATOMIC_RELEASE);
+            return sd.release();
+        }
+
+        sd->fd = shm_open(sd->name.c_str(), O_RDWR, 0666);
+        struct stat st;
+        if (sd->fd != -1 && fstat(sd->fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmDocHeader) &&
+            shmDocRemap(*sd) && __atomic_load_n(&sd->hdr()->magic, __ATOMIC_ACQUIRE) == SHM_DOC_MAGIC)
+        {
+            shmDocLock(*sd);
+            // the last member may have detached (and unlinked) meanwhile
+            bool live = __atomic_load_n(&sd->hdr()->magic, __ATOMIC_ACQUIRE) == SHM_DOC_MAGIC;
+            bool joined = live && shmDocJoin(*sd);
+            shmDocUnlock(*sd);
+            if (joined)
+                return sd.release();
+            if (live)
+            {
+                cerr << "[" << gUID << "] " << sd->name << " already has " << SHM_DOC_MEMBERS << " members\n";
+                attempt = 50;
+            }
+        }
+        if (sd->base)
+            munmap(sd->base, sd->mapped);
+        if (sd->fd != -1)
+            close(sd->fd);
+        sd->base = nullptr;
+        sd->mapped = 0;
+        sd->fd = -1;
+        sleepMS(20); // creator still initialising
+    }
+    cerr << "[" << gUID << "] Failed to attach shared segment " << sd->name << "\n";
+    if (sd->base)
+        munmap(sd->base, sd->mapped);
+    if (sd->fd != -1)
+        close(sd->fd);
+    return nullptr;
+}
+
+// Unmap; the last process to leave removes the segment.
+void shmDocDetach(ShmDoc *sd)
+{
+    if (!sd)
+        return;
+    shmDocLock(*sd);
+    for (int32_t &pid : sd->hdr()->members)
+    {
+        if (pid == (int32_t)getpid())
+            pid = 0;
+    }
+    if (shmDocReap(*sd) == 0)
+    {
+        __atomic_store_n(&sd->hdr()->magic, 0u, __ATOMIC_RELEASE);
+        shm_unlink(sd->name.c_str());
+    }
+    shmDocUnlock(*sd);
+    munmap(sd->base, sd->mapped);
+    close(sd->fd);
+    delete sd;
+}
@@ -0,0 +1,192 @@
+#include "headers.cpp"
+#include "pool.cpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SYNCTEXT_X86 1
+#endif
+
+// BYTE KERNELS (SSE2/AVX2, picked at startup)
+// First mismatch forward and backward (diff prefix/suffix) and single-byte
+// search (field delimiters). The AVX2 versions are compiled with a target
+// attribute and only called when the CPU has AVX2. SYNCTEXT_SIMD=scalar|sse2|avx2
+// picks a lower level than the best supported one, e.g. to compare runs.
+struct ByteKernels
+{
+    const char *name;
+    // bytes equal at the front of a[0..n) and b[0..n)
+    size_t (*prefix)(const char *a, const char *b, size_t n);
+    // bytes equal at the back, comparing backwards from aEnd and bEnd
+    size_t (*suffix)(const char *aEnd, const char *bEnd, size_t n);
+    // index of the first c in p[0..n), or n
+    size_t (*find)(const char *p, size_t n, char c);
+};
+
+static size_t prefixScalar(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static size_t suffixScalar(const char *aEnd, const char *bEnd, size_t n)
+{
+    size_t i = 0;
+    while (i < n && aEnd[-1 - (ptrdiff_t)i] == bEnd[-1 - (ptrdiff_t)i])
+        i++;
+    return i;
+}
+
+static size_t findScalar(const char *p, size_t n, char c)
+{
+    const void *hit = memchr(p, c, n);
+    return hit ? (size_t)((const char *)hit - p) : n;
+}
+
+#ifdef SYNCTEXT_X86
+// Inlined into the AVX2 kernels as their tail so it is VEX-encoded there;
+// calling legacy SSE code from AVX code costs a state transition.
+#define SIMD_INLINE static inline __attribute__((always_inline))
+
+SIMD_INLINE size_t prefixSse2(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        unsigned eq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (eq != 0xFFFFu)
+            return i + __builtin_ctz(~eq);
+    }
+    return i + prefixScalar(a + i, b + i, n - i);
+}
+
+SIMD_INLINE size_t suffixSse2(const char *aEnd, const char *bEnd, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(aEnd - i - 16));
+        __m128i y = _mm_loadu_si128((const __m128i *)(bEnd - i - 16));
+        unsigned ne = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFFu;
+        if (ne)
+            return i + (__builtin_clz(ne) - 16); // equal bytes above the highest mismatch
+    }
+    return i + suffixScalar(aEnd - i, bEnd - i, n - i);
+}
+
+SIMD_INLINE size_t findSse2(const char *p, size_t n, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned hit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, needle));
+        if (hit)
+            return i + __builtin_ctz(hit);
+    }
+    for (; i < n; ++i)
+    {
+        if (p[i] == c)
+            return i;
+    }
+    return n;
+}
+
+__attribute__((target("avx2"))) static size_t prefixAvx2(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        unsigned eq = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (eq != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~eq);
+    }
+    return i + prefixSse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t suffixAvx2(const char *aEnd, const char *bEnd, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(aEnd - i - 32));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(bEnd - i - 32));
+        unsigned ne = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (ne)
+            return i + __builtin_clz(ne);
+    }
+    return i + suffixSse2(aEnd - i, bEnd - i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t findAvx2(const char *p, size_t n, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned hit = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, needle));
+        if (hit)
+            return i + __builtin_ctz(hit);
+    }
+    return i + findSse2(p + i, n - i, c);
+}
+#endif
+
+static const ByteKernels KERNELS_SCALAR = {"scalar", prefixScalar, suffixScalar, findScalar};
+#ifdef SYNCTEXT_X86
+static const ByteKernels KERNELS_SSE2 = {"sse2", prefixSse2, suffixSse2, findSse2};
+static const ByteKernels KERNELS_AVX2 = {"avx2", prefixAvx2, suffixAvx2, findAvx2};
+#endif
+
+// Every level this CPU runs, slowest first.
+vector<const ByteKernels *> byteKernelLevels()
+{
+    vector<const ByteKernels *> levels{&KERNELS_SCALAR};
+#ifdef SYNCTEXT_X86
+    levels.push_back(&KERNELS_SSE2);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        levels.push_back(&KERNELS_AVX2);
+#endif
+    return levels;
+}
+
+static const ByteKernels *selectByteKernels()
+{
+    vector<const ByteKernels *> levels = byteKernelLevels();
+    const char *env = getenv("SYNCTEXT_SIMD");
+    if (env)
+    {
+        for (const ByteKernels *k : levels)
+        {
+            if (strcmp(k->name, env) == 0)
+                return k;
+        }
+    }
+    return levels.back();
+}
+static const ByteKernels *gBytes = selectByteKernels();
+
+inline size_t commonPrefix(string_view a, string_view b)
+{
+    return gBytes->prefix(a.data(), b.data(), min(a.size(), b.size()));
+}
+// Limited to `limit` bytes so it never reaches into a common prefix.
+inline size_t commonSuffix(string_view a, string_view b, size_t limit)
+{
+    return gBytes->suffix(a.data() + a.size(), b.data() + b.size(), min(limit, min(a.size(), b.size())));
+}
+// string_view::find for one byte.
+inline size_t findByte(string_view s, char c, size_t from = 0)
+{
+    if (from >= s.size())
+        return string_view::npos;
+    size_t at = from + gBytes->find(s.data() + from, s.size() - from, c);
+    return at == s.size() ? string_view::npos : at;
+}
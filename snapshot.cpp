@@ -0,0 +1,247 @@
+#include "headers.cpp"
+#include "trace.cpp"
+
+// SNAPSHOTS (<uid>_<doc_id>.snap)
+// The merged state of a document in a layout that loads from a mapping
+// without parsing: line table (offset, length, hash) into one text block,
+// the site table and the LWW winner index, all 8-byte aligned after a fixed
+// header. The header records the stamp of the text file the snapshot
+// matches; only when the file on disk still carries it is the snapshot
+// used. Startup then copies lines out of the mapping and takes their
+// hashes from the table instead of reading, splitting and hashing the text,
+// and restores the winner index; loading is still a pass over the whole
+// file (the checksum) and a copy of every line. Otherwise the snapshot
+// describes other text, spans included, and is ignored. A checksum over
+// everything after the header guards against torn or foreign files.
+const char SNAP_MAGIC[8] = {'S', 'T', 'S', 'N', 'A', 'P', '1', '\0'};
+const uint32_t SNAP_VERSION = 1;
+const int SNAPSHOT_INTERVAL_SEC = 30; // background snapshot cadence while merging
+
+struct SnapHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t fileSize;
+    uint64_t numLines, textBytes, numSites, numSpans;
+    uint64_t tableOff, textOff, sitesOff, spansOff;
+    FileStamp text;       // <uid>_<doc_id>.txt this snapshot was taken against
+    int64_t maxTimestamp; // document clock: newest winner applied
+    int64_t createdAt;
+    uint64_t checksum; // lineHash of bytes [sizeof(SnapHeader), fileSize)
+};
+
+struct SnapLine
+{
+    uint64_t off;
+    uint32_t len;
+    uint32_t pad;
+    uint64_t hash;
+};
+
+struct SnapSite
+{
+    char uid[uid_LEN];
+};
+
+struct SnapSpan
+{
+    int32_t line, start, end;
+    uint16_t site; // index into the site table
+    uint16_t pad;
+    int64_t timestamp;
+};
+
+// Everything a snapshot holds besides the lines, captured on the main
+// thread (site ids are resolved to names there).
+struct SnapshotData
+{
+    vector<uint64_t> hashes;
+    vector<string> sites;
+    vector<SnapSpan> spans;
+    int64_t maxTimestamp = 0;
+};
+
+string snapshotPath(const Document &d)
+{
+    return gUID + "_" + d.id + ".snap";
+}
+
+shared_ptr<SnapshotData> snapshotCapture(const Document &d)
+{
+    auto data = make_shared<SnapshotData>();
+    data->hashes = d.linesHash;
+    map<uint16_t, uint16_t> siteIdx;
+    for (const auto &kv : d.winners)
+    {
+        for (const LwwSpan &s : kv.second)
+        {
+            auto it = siteIdx.find(s.site);
+            if (it == siteIdx.end())
+            {
+                it = siteIdx.emplace(s.site, (uint16_t)data->sites.size()).first;
+                data->sites.push_back(gSites.name(s.site));
+            }
+            data->spans.push_back(SnapSpan{kv.first, s.start, s.end, it->second, 0, (int64_t)s.timestamp});
+            data->maxTimestamp = max(data->maxTimestamp, (int64_t)s.timestamp);
+        }
+    }
+    return data;
+}
+
+static uint64_t snapAlign(uint64_t n)
+{
+    return (n + 7) & ~uint64_t(7);
+}
+
+// Written through a mapping of a temporary file that is renamed over the
+// old snapshot, so a reader never sees a half-written one.
+bool snapshotWrite(const string &path, const vector<string> &lines, const SnapshotData &data, const FileStamp &text)
+{
+    SnapHeader h{};
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    h.numLines = lines.size();
+    h.numSites = data.sites.size();
+    h.numSpans = data.spans.size();
+    for (const string &l : lines)
+        h.textBytes += l.size();
+    h.tableOff = snapAlign(sizeof(SnapHeader));
+    h.textOff = h.tableOff + h.numLines * sizeof(SnapLine);
+    h.sitesOff = snapAlign(h.textOff + h.textBytes);
+    h.spansOff = h.sitesOff + h.numSites * sizeof(SnapSite);
+    h.fileSize = h.spansOff + h.numSpans * sizeof(SnapSpan);
+    h.text = text;
+    h.maxTimestamp = data.maxTimestamp;
+    h.createdAt = (int64_t)time(nullptr);
+
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, (off_t)h.fileSize) != 0)
+    {
+        perror(("snapshot " + tmp).c_str());
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    char *base = (char *)mmap(nullptr, h.fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("snapshot mmap");
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    SnapLine *table = (SnapLine *)(base + h.tableOff);
+    uint64_t off = 0;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        uint64_t hash = i < data.hashes.size() ? data.hashes[i] : lineHash(lines[i]);
+        table[i] = SnapLine{off, (uint32_t)lines[i].size(), 0, hash};
+        memcpy(base + h.textOff + off, lines[i].data(), lines[i].size());
+        off += lines[i].size();
+    }
+    SnapSite *sites = (SnapSite *)(base + h.sitesOff);
+    for (size_t i = 0; i < data.sites.size(); ++i)
+        strncpy(sites[i].uid, data.sites[i].c_str(), uid_LEN - 1);
+    if (!data.spans.empty())
+        memcpy(base + h.spansOff, data.spans.data(), data.spans.size() * sizeof(SnapSpan));
+
+    h.checksum = lineHash(string_view(base + sizeof(SnapHeader), h.fileSize - sizeof(SnapHeader)));
+    memcpy(base, &h, sizeof(h));
+    munmap(base, h.fileSize);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        perror(("snapshot " + path).c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Restore d (lines, observed, their hashes and the winner index) from its
+// snapshot, if it is intact and `text` (the file on disk) is the version it
+// was taken against. False, with d untouched, otherwise.
+bool snapshotLoad(Document &d, const FileStamp &text)
+{
+    string path = snapshotPath(d);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapHeader))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *base = (const char *)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    const SnapHeader &h = *(const SnapHeader *)base;
+    if (!(h.text == text))
+    {
+        // taken against other text: its spans would judge this text's edits
+        munmap((void *)base, size);
+        return false;
+    }
+    bool ok = memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) == 0 && h.version == SNAP_VERSION && h.fileSize == size &&
+              h.tableOff >= sizeof(SnapHeader) && h.numLines <= (size - h.tableOff) / sizeof(SnapLine) &&
+              h.textOff == h.tableOff + h.numLines * sizeof(SnapLine) && h.textBytes <= size - h.textOff &&
+              h.sitesOff >= h.textOff + h.textBytes && h.numSites <= (size - h.sitesOff) / sizeof(SnapSite) &&
+              h.spansOff == h.sitesOff + h.numSites * sizeof(SnapSite) &&
+              h.numSpans <= (size - h.spansOff) / sizeof(SnapSpan) &&
+              h.checksum == lineHash(string_view(base + sizeof(SnapHeader), size - sizeof(SnapHeader)));
+    if (!ok)
+    {
+        std::cerr << "[" << gUID << "] WARN: ignoring damaged snapshot " << path << "\n";
+        munmap((void *)base, size);
+        return false;
+    }
+
+    const SnapLine *table = (const SnapLine *)(base + h.tableOff);
+    for (size_t i = 0; ok && i < h.numLines; ++i)
+        ok = table[i].off <= h.textBytes && table[i].len <= h.textBytes - table[i].off;
+    if (!ok)
+    {
+        std::cerr << "[" << gUID << "] WARN: ignoring damaged snapshot " << path << "\n";
+        munmap((void *)base, size);
+        return false;
+    }
+
+    const SnapSite *sites = (const SnapSite *)(base + h.sitesOff);
+    vector<uint16_t> siteIds(h.numSites);
+    for (size_t i = 0; i < h.numSites; ++i)
+        siteIds[i] = gSites.id(string(sites[i].uid, strnlen(sites[i].uid, uid_LEN)));
+    const SnapSpan *spans = (const SnapSpan *)(base + h.spansOff);
+    d.winners.clear();
+    for (size_t i = 0; i < h.numSpans; ++i)
+    {
+        const SnapSpan &s = spans[i];
+        if (s.site < h.numSites) // written in line, start order
+            d.winners[s.line].push_back(LwwSpan{s.start, s.end, (time_t)s.timestamp, siteIds[s.site]});
+    }
+    stampSeen((time_t)h.maxTimestamp); // edits made from here on beat the restored ones
+
+    // lines and observed are built in one pass over the mapping, split
+    // across the work pool: copying into strings is all that is left
+    const char *textBase = base + h.textOff;
+    d.lines.assign(h.numLines, string());
+    d.observed.assign(h.numLines, string());
+    d.linesHash.resize(h.numLines);
+    workPool().parallelFor(h.numLines, PAR_DIFF_GRAIN, [&](size_t lo, size_t hi)
+    {
+        for (size_t i = lo; i < hi; ++i)
+        {
+            d.lines[i].assign(textBase + table[i].off, table[i].len);
+            d.observed[i].assign(textBase + table[i].off, table[i].len);
+            d.linesHash[i] = table[i].hash;
+        }
+    });
+    d.observedHash = d.linesHash;
+    munmap((void *)base, size);
+    return true;
+}
@@ -0,0 +1,270 @@
+#include "headers.cpp"
+#include "snapshot.cpp"
+
+// PIPELINE STAGES
+//   receive (listener) -> decode -> merge + apply (main loop) -> persist
+//                                                             -> render
+// Every arrow is an SpscRing drained by its own thread. Decode passes every
+// record on; persist and render act only on the newest snapshot they find,
+// so a slow disk or terminal never delays the next merge. Merge and apply
+// stay on the main loop together: apply changes the state the next diff and
+// merge read.
+const int STAGE_IDLE_MS = 200;
+
+template <class T>
+class Stage
+{
+    SpscRing<T> ring;
+    StageWake wake;
+    atomic<bool> stopping{false};
+    thread th;
+    function<void(vector<T> &)> work; // everything queued since the last pass
+
+    void loop()
+    {
+        vector<T> batch;
+        for (;;)
+        {
+            bool last = stopping.load(); // one more pass for the final posts
+            T item;
+            while (ring.pop(item))
+                batch.push_back(std::move(item));
+            if (!batch.empty())
+            {
+                work(batch);
+                batch.clear();
+            }
+            if (last)
+                break;
+            wake.wait(STAGE_IDLE_MS);
+        }
+    }
+
+public:
+    explicit Stage(function<void(vector<T> &)> fn) : ring(STAGE_RING_CAPACITY), work(std::move(fn)) {}
+
+    void start()
+    {
+        stopping.store(false);
+        th = thread(&Stage::loop, this);
+    }
+    // Drains what is queued, then joins.
+    void stop()
+    {
+        if (!th.joinable())
+            return;
+        stopping.store(true);
+        wake.notify();
+        th.join();
+    }
+    // Single producer. Runs the work inline when the stage is not running;
+    // false (and `item` untouched) when the ring is full.
+    bool post(T &&item)
+    {
+        if (!th.joinable())
+        {
+            vector<T> one;
+            one.push_back(std::move(item));
+            work(one);
+            return true;
+        }
+        if (!ring.push(std::move(item)))
+            return false;
+        wake.notify();
+        return true;
+    }
+};
+
+const int STAGE_FULL_WAIT_MS = 1; // retry interval while the next stage is full
+
+// DECODE: reassemble and decompress frames into update records. Sequenced
+// messages are acked once the listener has taken them, so nothing past it
+// drops one: while the main loop is behind, decode waits for it (and the
+// listener, in turn, for decode).
+static void decodeBatch(vector<string> &msgs)
+{
+    bool waited = false;
+    for (const string &msg : msgs)
+    {
+        vector<string> records;
+        if (!wireAccept(msg, records))
+        {
+            std::cerr << "[" << gUID << "] Received (badly formed) message\n";
+            continue;
+        }
+        for (string &r : records)
+        {
+            while (!gRingRecv.push(std::move(r)))
+            {
+                if (gExit.load())
+                    return;
+                if (!waited)
+                    std::cerr << "[" << gUID << "] WARN: recv ring full, waiting for the main loop\n";
+                waited = true;
+                wakeMainLoop();
+                this_thread::sleep_for(chrono::milliseconds(STAGE_FULL_WAIT_MS));
+            }
+        }
+    }
+    wakeMainLoop();
+}
+static Stage<string> gDecode(decodeBatch);
+
+// Queue msg for decode, waiting while it is full. False only on exit.
+static bool postDecode(string &&msg)
+{
+    bool waited = false;
+    while (!gDecode.post(std::move(msg)))
+    {
+        if (gExit.load())
+            return false;
+        if (!waited)
+            std::cerr << "[" << gUID << "] WARN: decode queue full, waiting\n";
+        waited = true;
+        this_thread::sleep_for(chrono::milliseconds(STAGE_FULL_WAIT_MS));
+    }
+    return true;
+}
+
+// PERSIST: write merged state back to the editor files. Files are replaced
+// by rename, and the version written is remembered so the file poll can
+// tell our writes from the user's. Every SNAPSHOT_INTERVAL_SEC a job also
+// carries a snapshot, written right after the text and stamped with it.
+struct PersistJob
+{
+    string path;
+    uint64_t gen = 0;
+    vector<string> lines;
+    shared_ptr<SnapshotData> snapshot;
+    string snapshotPath;
+};
+
+struct PersistDone
+{
+    uint64_t gen = 0;
+    FileStamp stamp;
+};
+static mutex gPersistMu;
+static map<string, PersistDone> gPersistDone; // by path
+
+static void persistWrite(const PersistJob &job)
+{
+    string tmp = job.path + ".tmp";
+    writeLinesFile(tmp, job.lines);
+    struct stat st;
+    if (stat(tmp.c_str(), &st) != 0 || rename(tmp.c_str(), job.path.c_str()) != 0)
+    {
+        perror(("persist " + job.path).c_str());
+        return;
+    }
+    {
+        lock_guard<mutex> lk(gPersistMu);
+        gPersistDone[job.path] = PersistDone{job.gen, fileStamp(st)};
+    }
+    if (job.snapshot)
+        snapshotWrite(job.snapshotPath, job.lines, *job.snapshot, fileStamp(st));
+}
+
+static void persistBatch(vector<PersistJob> &jobs)
+{
+    map<string, PersistJob *> latest;
+    for (PersistJob &j : jobs)
+    {
+        // a skipped job's snapshot (spans, clock) describes its own older
+        // lines: it goes with them, and the next interval, or exit, takes a
+        // fresh one (snapshotGen is behind persistGen from here on)
+        latest[j.path] = &j;
+    }
+    for (const auto &kv : latest)
+        persistWrite(*kv.second);
+}
+static Stage<PersistJob> gPersist(persistBatch);
+
+enum class DiskState
+{
+    Unknown, // not written by us, or changed since
+    Pending, // our latest snapshot is not on disk yet
+    Ours     // exactly the version we wrote last
+};
+
+DiskState persistState(const Document &d, const FileStamp &now)
+{
+    lock_guard<mutex> lk(gPersistMu);
+    auto it = gPersistDone.find(d.path);
+    uint64_t done = it == gPersistDone.end() ? 0 : it->second.gen;
+    if (done < d.persistGen)
+        return DiskState::Pending;
+    return (it != gPersistDone.end() && it->second.stamp == now) ? DiskState::Ours : DiskState::Unknown;
+}
+
+// Hand the current lines to the persist stage; retried every step while its
+// ring is full.
+void postPersist(Document &d)
+{
+    if (!d.persistPending)
+        return;
+    PersistJob job{d.path, d.persistGen, d.lines, nullptr, ""};
+    time_t now = time(nullptr);
+    bool snap = now - d.snapshotAt >= SNAPSHOT_INTERVAL_SEC;
+    if (snap)
+    {
+        job.snapshot = snapshotCapture(d);
+        job.snapshotPath = snapshotPath(d);
+    }
+    if (!gPersist.post(std::move(job)))
+        return;
+    d.persistPending = false;
+    if (snap)
+    {
+        d.snapshotAt = now;
+        d.snapshotGen = d.persistGen;
+        d.snapshotFresh = true;
+    }
+}
+
+void persistDocument(Document &d)
+{
+    d.persistGen++;
+    d.persistPending = true;
+    postPersist(d);
+}
+
+// Called once the persist stage has stopped: snapshot every document whose
+// merged state moved past its last snapshot, provided the file on disk is
+// that state (the snapshot is only used against the text it was taken with).
+void snapshotOnExit(Document &d)
+{
+    if (d.snapshotFresh && d.snapshotGen == d.persistGen)
+        return;
+    struct stat st;
+    if (stat(d.path.c_str(), &st) != 0)
+        return;
+    FileStamp now = fileStamp(st);
+    DiskState ds = persistState(d, now);
+    bool onDisk = ds == DiskState::Ours || (ds == DiskState::Unknown && now == d.seen && d.observedHash == d.linesHash);
+    if (!onDisk)
+        return;
+    shared_ptr<SnapshotData> data = snapshotCapture(d);
+    if (snapshotWrite(snapshotPath(d), d.lines, *data, now))
+    {
+        d.snapshotFresh = true;
+        d.snapshotGen = d.persistGen;
+    }
+}
+
+// RENDER: draw the newest frame. Frames skipped in between were never on
+// screen, so changes are highlighted against the oldest frame's baseline.
+static void renderBatch(vector<RenderFrame> &frames)
+{
+    RenderFrame &f = frames.back();
+    for (RenderFrame &g : frames)
+    {
+        if (g.path == f.path)
+        {
+            f.baseline.swap(g.baseline);
+            break;
+        }
+    }
+    renderFrame(f, gReg);
+}
+static Stage<RenderFrame> gRender(renderBatch);
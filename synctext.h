@@ -0,0 +1,89 @@
+// libsynctext: embeddable replica API
+//
+// A process hosts one replica (one uid) with any number of documents. Edits
+// are either submitted directly with stInsert()/stDelete() or picked up from
+// <uid>_<doc_id>.txt when file watching is on; remote edits are merged with
+// the same LWW rules as the control client and reported through the
+// remote-change callback. Every call may come from any thread; callbacks run
+// on the thread driving stStep()/stRun().
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define SYNCTEXT_API __attribute__((visibility("default")))
+
+struct StConfig
+{
+    std::string uid;
+    std::string transport = "mq";       // mq, unix or tcp
+    std::vector<std::string> docs;      // opened before going live; empty = "doc"
+    bool watchFiles = true;             // diff <uid>_<doc_id>.txt when it is saved
+    bool terminalUi = false;            // render the focused document on stdout
+    int relayFanout = 0;                // >0: k-ary relay tree once every peer agrees on k
+    bool shared = false;                // keep documents in shared memory with same-host peers
+    std::string tracePath;              // record received messages and merges here (replay input)
+    bool streamMerge = false;           // merge each update as it arrives instead of in batches
+};
+
+// One applied edit from another site. Columns refer to the line as it was
+// before the merge that applied it.
+struct StChange
+{
+    std::string docId;
+    std::string site;
+    char op; // 'i'nsert, 'd'elete or 'r'eplace
+    int line;
+    int startCol;
+    int endCol;
+    std::string oldText;
+    std::string newText;
+};
+
+using StChangeCallback = std::function<void(const StChange &)>;
+
+SYNCTEXT_API bool stValidDocId(const std::string &id);
+
+// Register in the shared registry, open the endpoint and the documents, and
+// start the receive threads. Only one replica per process.
+SYNCTEXT_API bool stStart(const StConfig &cfg);
+// Host another document while running.
+SYNCTEXT_API bool stOpenDocument(const std::string &docId);
+
+// Direct edits on the local view of a line (no newlines in `text`).
+SYNCTEXT_API bool stInsert(const std::string &docId, int line, int col, const std::string &text);
+SYNCTEXT_API bool stDelete(const std::string &docId, int line, int startCol, int endCol);
+// Local view of a document: merged state plus edits not merged yet.
+SYNCTEXT_API bool stLines(const std::string &docId, std::vector<std::string> &out);
+
+// Partial replication: follow only lines [lo, hi) of a document (the first
+// call narrows it, later calls widen it and fetch the lines from a peer that
+// follows all of it). Edits outside the followed lines widen it as well.
+SYNCTEXT_API bool stFollowLines(const std::string &docId, int lo, int hi);
+SYNCTEXT_API bool stFollowAll(const std::string &docId);
+
+SYNCTEXT_API void stOnRemoteChange(StChangeCallback cb);
+
+// Wait up to `timeoutMs` for traffic, then poll files, send, route and merge
+// once. Updates go out and merge in batches (or merge at once with
+// streamMerge); stFlush() sends every pending local edit and merges whatever
+// has arrived. Updates older than what was already applied to their span
+// are dropped, whichever batch they arrive in.
+SYNCTEXT_API void stStep(int timeoutMs);
+SYNCTEXT_API void stFlush();
+// Step until stStop(), then stShutdown(). Returns the exit code.
+SYNCTEXT_API int stRun();
+// Ask stRun() to return; only sets a flag, so it is safe in a signal handler.
+SYNCTEXT_API void stStop();
+// Join the threads, leave the registry and close the endpoint.
+SYNCTEXT_API void stShutdown();
+
+// Standalone modes of the control binary.
+SYNCTEXT_API int stRunBroker();
+SYNCTEXT_API int stRunBench(size_t lines, size_t maxThreads);
+// Feed a recorded trace through the merge engine; `realtime` keeps the
+// recorded pacing, `raw` decodes received updates from the recorded frames
+// instead. Prints throughput and the final document hashes.
+SYNCTEXT_API int stRunReplay(const std::string &tracePath, bool realtime, bool raw = false);
@@ -0,0 +1,146 @@
+#include "headers.cpp"
+#include "transport.cpp"
+
+// TRACE CAPTURE (control --record=<file>)
+// Appends what the merge engine consumes to a binary trace so a session can
+// be replayed offline (control --replay). Layout, little-endian:
+//   header: "STTRACE2" | u64 wall-clock start (ns) | u32 relay k | u16 len | uid
+//   record: u64 ns since start | u8 kind | u32 len | payload
+// Kinds: TRACE_OPEN "doc_id\0" then every line ending in '\n', when a
+// document is opened; TRACE_WINNERS a stamps record (file.cpp) of winner
+// spans recorded outside a merge (restored from a snapshot, or sent along
+// with a catch-up copy); TRACE_LOCAL and TRACE_RECV each local and received
+// update (wire record) as it enters a merge, so batches and stale checks are
+// the ones the replica saw; TRACE_MERGE "doc_id" where a merge ran;
+// TRACE_RELOAD, laid out like TRACE_OPEN, where a shared document was
+// reloaded from its segment; TRACE_RAW every message the listener received,
+// as it came off the transport (acks, line requests and duplicates
+// included), for replaying the receive path itself (--raw).
+const char TRACE_MAGIC[8] = {'S', 'T', 'T', 'R', 'A', 'C', 'E', '2'};
+const uint32_t TRACE_MAX_RECORD = 64u << 20;
+
+enum TraceKind : uint8_t
+{
+    TRACE_OPEN = 'O',
+    TRACE_WINNERS = 'W',
+    TRACE_RECV = 'R',
+    TRACE_LOCAL = 'L',
+    TRACE_MERGE = 'G',
+    TRACE_RELOAD = 'S',
+    TRACE_RAW = 'F',
+};
+
+struct TraceRecord
+{
+    uint64_t ns = 0;
+    uint8_t kind = 0;
+    string payload;
+};
+
+struct TraceHeader
+{
+    uint64_t startNs = 0;
+    uint32_t relayK = 0;
+    string uid;
+};
+
+static FILE *gTrace = nullptr;
+static mutex gTraceMu;
+static atomic<bool> gTracing{false};
+static chrono::steady_clock::time_point gTraceStart;
+
+bool traceOpen(const string &path)
+{
+    lock_guard<mutex> lk(gTraceMu);
+    if (gTrace)
+        return true;
+    gTrace = fopen(path.c_str(), "wb");
+    if (!gTrace)
+    {
+        perror(("trace " + path).c_str());
+        return false;
+    }
+    uint64_t wall = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::system_clock::now().time_since_epoch())
+                        .count();
+    uint16_t ulen = (uint16_t)gUID.size();
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), gTrace);
+    fwrite(&wall, sizeof(wall), 1, gTrace);
+    fwrite(&gRelayFanout, sizeof(gRelayFanout), 1, gTrace);
+    fwrite(&ulen, sizeof(ulen), 1, gTrace);
+    fwrite(gUID.data(), 1, ulen, gTrace);
+    gTraceStart = chrono::steady_clock::now();
+    gTracing.store(true);
+    std::cerr << "[" << gUID << "] Recording trace to " << path << "\n";
+    return true;
+}
+
+void traceRecord(uint8_t kind, string_view payload)
+{
+    if (!gTracing.load(memory_order_relaxed))
+        return;
+    lock_guard<mutex> lk(gTraceMu);
+    if (!gTrace)
+        return;
+    uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+                      chrono::steady_clock::now() - gTraceStart)
+                      .count();
+    uint32_t len = (uint32_t)payload.size();
+    fwrite(&ns, sizeof(ns), 1, gTrace);
+    fwrite(&kind, sizeof(kind), 1, gTrace);
+    fwrite(&len, sizeof(len), 1, gTrace);
+    if (len && fwrite(payload.data(), 1, len, gTrace) != len)
+    {
+        perror("trace write");
+        fclose(gTrace);
+        gTrace = nullptr;
+        gTracing.store(false);
+    }
+}
+
+void traceDocument(const string &docId, const vector<string> &lines, uint8_t kind = TRACE_OPEN)
+{
+    if (!gTracing.load(memory_order_relaxed))
+        return;
+    string payload = docId;
+    payload.push_back('\0');
+    for (const string &l : lines)
+    {
+        payload += l;
+        payload.push_back('\n');
+    }
+    traceRecord(kind, payload);
+}
+
+void traceClose()
+{
+    lock_guard<mutex> lk(gTraceMu);
+    gTracing.store(false);
+    if (gTrace)
+        fclose(gTrace);
+    gTrace = nullptr;
+}
+
+bool traceReadHeader(FILE *f, TraceHeader &h)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    uint16_t ulen = 0;
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        fread(&h.startNs, sizeof(h.startNs), 1, f) != 1 || fread(&h.relayK, sizeof(h.relayK), 1, f) != 1 ||
+        fread(&ulen, sizeof(ulen), 1, f) != 1)
+        return false;
+    h.uid.resize(ulen);
+    return fread(&h.uid[0], 1, ulen, f) == ulen;
+}
+
+// False at the end of the trace or on a truncated record (a recorder that
+// was killed mid-write).
+bool traceReadRecord(FILE *f, TraceRecord &r)
+{
+    uint32_t len = 0;
+    if (fread(&r.ns, sizeof(r.ns), 1, f) != 1 || fread(&r.kind, sizeof(r.kind), 1, f) != 1 ||
+        fread(&len, sizeof(len), 1, f) != 1 || len > TRACE_MAX_RECORD)
+        return false;
+    r.payload.resize(len);
+    return len == 0 || fread(&r.payload[0], 1, len, f) == len;
+}
@@ -0,0 +1,1022 @@
+#include "headers.cpp"
+#include "wire.cpp"
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+// TRANSPORT
+// Peers advertise an endpoint in the registry's qName slot:
+//   /mq_<uid>                 POSIX message queue
+//   unix:/tmp/synctext_<uid>.sock
+//   tcp:<host>:<port>
+// Each process receives on one backend (--transport=mq|unix|tcp) but can send
+// to any endpoint, so mixed groups still converge. Stream backends frame every
+// message with a 4-byte big-endian length and keep outbound connections open.
+// Every outbound write happens on the sender thread (see SENDER THREAD), which
+// owns the descriptors; backends only ever write without blocking.
+const size_t STREAM_MAX_MSG = 16u << 20;
+const int STREAM_BACKLOG = 16;
+const char *UNIX_SOCK_PREFIX = "/tmp/synctext_";
+
+// A sequenced message kept until the peer acknowledges it.
+struct Unacked
+{
+    string frame; // with its link header
+    chrono::steady_clock::time_point sentAt;
+};
+
+// Outbound state of one peer; owned by the sender thread.
+struct OutQueue
+{
+    class Transport *t = nullptr;
+    string endpoint;
+    deque<string> frames;
+    size_t offset = 0;    // bytes of frames.front() (with its header) already written
+    size_t sentBytes = 0; // payload bytes written since the last log line
+    int failures = 0;     // consecutive attempts that could not reach the peer
+    int waitFd = -1;      // registered for EPOLLOUT while the peer is full
+    chrono::steady_clock::time_point retryAt{};
+    // sequenced delivery (see SEQUENCED DELIVERY)
+    uint64_t stream = 0;
+    uint64_t nextSeq = 1;
+    map<uint64_t, Unacked> unacked; // by seq
+    int rtoMs = 0;                  // current retransmission timeout
+};
+
+// Acks are not worth a "Sent to" line.
+static void countSent(OutQueue &q, const string &m)
+{
+    if (m.compare(0, 2, "A|") != 0)
+        q.sentBytes += m.size();
+}
+
+enum class SendStatus
+{
+    Sent,  // queue drained
+    Again, // peer full (EAGAIN); wait for sendFd() to poll writable
+    Failed // peer unreachable; retry later
+};
+
+class Transport
+{
+public:
+    virtual ~Transport() {}
+    virtual const char *name() const = 0;
+    // Start receiving for `uid`; fills the endpoint peers should send to.
+    virtual bool openSelf(const string &uid, string &endpoint) = 0;
+    virtual void closeSelf() = 0;
+    // Largest single message a receiver on this backend accepts.
+    virtual size_t maxMessage() const = 0;
+    // What a wire frame may use of it: the sender adds a link header.
+    size_t frameBudget() const { return maxMessage() - LINK_HEADER_RESERVE; }
+    // Wait up to timeout_ms for the next message. Listener thread only.
+    virtual bool receive(string &msg, int timeout_ms) = 0;
+    // Write as much of q.frames as the peer takes without blocking, popping
+    // every frame that went out whole. Sender thread only.
+    virtual SendStatus flush(OutQueue &q) = 0;
+    // Descriptor that polls writable once flush() can make progress, or -1.
+    virtual int sendFd(const string &endpoint) const
+    {
+        (void)endpoint;
+        return -1;
+    }
+    // Drop any descriptor kept open for `endpoint` (peer left or restarted).
+    virtual void forget(const string &endpoint) { (void)endpoint; }
+};
+
+// MQ BACKEND
+// Outbound queues stay open until the peer cache says the peer went away.
+class MqTransport : public Transport
+{
+    string qName;
+    map<string, mqd_t> conns;
+
+public:
+    const char *name() const override { return "mq"; }
+    bool openSelf(const string &uid, string &endpoint) override
+    {
+        qName = string("/mq_") + uid;
+        if (!createSelfQ(qName))
+            return false;
+        endpoint = qName;
+        return true;
+    }
+    void closeSelf() override
+    {
+        if (!qName.empty())
+            clearSelfQ(qName);
+    }
+    size_t maxMessage() const override { return gMQ_msgsize; }
+    bool receive(string &msg, int timeout_ms) override
+    {
+        static thread_local vector<char> buffer;
+        buffer.resize(gMQ_msgsize + 10);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        ssize_t n = mq_timedreceive(gMQ, buffer.data(), buffer.size(), nullptr, &ts);
+        if (n < 0)
+            return false;
+        msg.assign(buffer.data(), static_cast<size_t>(n));
+        return true;
+    }
+    SendStatus flush(OutQueue &q) override
+    {
+        auto it = conns.find(q.endpoint);
+        if (it == conns.end())
+        {
+            mqd_t mq = mq_open(q.endpoint.c_str(), O_WRONLY | O_NONBLOCK);
+            if (mq == (mqd_t)-1)
+                return SendStatus::Failed;
+            it = conns.emplace(q.endpoint, mq).first;
+        }
+        while (!q.frames.empty())
+        {
+            const string &m = q.frames.front();
+            if (m.size() > gMQ_msgsize)
+            {
+                cerr << "[" << gUID << "] ERROR: message too large for mq (size="
+                     << m.size() << " max=" << gMQ_msgsize << ")\n";
+                q.frames.pop_front();
+                continue;
+            }
+            if (mq_send(it->second, m.data(), m.size(), 0) == -1)
+            {
+                if (errno == EAGAIN)
+                    return SendStatus::Again;
+                perror(("mq_send " + q.endpoint).c_str());
+                forget(q.endpoint);
+                return SendStatus::Failed;
+            }
+            countSent(q, m);
+            q.frames.pop_front();
+        }
+        return SendStatus::Sent;
+    }
+    int sendFd(const string &endpoint) const override
+    {
+        auto it = conns.find(endpoint);
+        return it == conns.end() ? -1 : (int)it->second;
+    }
+    void forget(const string &endpoint) override
+    {
+        auto it = conns.find(endpoint);
+        if (it == conns.end())
+            return;
+        mq_close(it->second);
+        conns.erase(it);
+    }
+};
+
+// STREAM BACKEND (unix domain / tcp sockets)
+class StreamTransport : public Transport
+{
+    bool tcp;
+    int listenFd = -1;
+    int ep = -1;
+    string sockPath;
+    map<int, string> inbuf; // partial frames per accepted connection
+    deque<string> ready;
+    map<string, int> conns; // persistent outbound connections
+    set<int> connecting;    // ...whose connect() has not completed yet
+
+    static bool parseTcp(const string &addr, struct sockaddr_in &sa)
+    {
+        size_t colon = addr.rfind(':');
+        if (colon == string::npos)
+            return false;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons((uint16_t)atoi(addr.c_str() + colon + 1));
+        return inet_pton(AF_INET, addr.substr(0, colon).c_str(), &sa.sin_addr) == 1;
+    }
+
+    // Start a non-blocking connect; a descriptor still connecting is put in
+    // `connecting` and finished by flush() once it polls writable.
+    int connectTo(const string &endpoint)
+    {
+        int fd = -1, r = -1;
+        if (endpoint.compare(0, 5, "unix:") == 0)
+        {
+            struct sockaddr_un sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sun_family = AF_UNIX;
+            strncpy(sa.sun_path, endpoint.c_str() + 5, sizeof(sa.sun_path) - 1);
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd != -1)
+                r = connect(fd, (struct sockaddr *)&sa, sizeof(sa));
+        }
+        else if (endpoint.compare(0, 4, "tcp:") == 0)
+        {
+            struct sockaddr_in sa;
+            if (!parseTcp(endpoint.substr(4), sa))
+                return -1;
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int one = 1;
+            if (fd != -1)
+            {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                r = connect(fd, (struct sockaddr *)&sa, sizeof(sa));
+            }
+        }
+        if (fd == -1 || r == 0)
+            return fd;
+        if (errno == EINPROGRESS)
+        {
+            connecting.insert(fd);
+            return fd;
+        }
+        close(fd); // refused, or a unix listener's backlog is full (EAGAIN): retry later
+        return -1;
+    }
+
+    // Outcome of a connect still in progress on fd: Sent once connected.
+    SendStatus finishConnect(int fd)
+    {
+        struct pollfd pfd;
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 0) == 0)
+            return SendStatus::Again;
+        connecting.erase(fd);
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+            return SendStatus::Failed;
+        return SendStatus::Sent;
+    }
+
+    void dropConn(int fd)
+    {
+        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        inbuf.erase(fd);
+    }
+
+    void readConn(int fd)
+    {
+        string &buf = inbuf[fd];
+        char chunk[65536];
+        for (;;)
+        {
+            ssize_t r = read(fd, chunk, sizeof(chunk));
+            if (r > 0)
+            {
+                buf.append(chunk, (size_t)r);
+                continue;
+            }
+            if (r < 0 && (errno == EINTR))
+                continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            dropConn(fd); // EOF or error
+            return;
+        }
+
+        size_t at = 0;
+        while (buf.size() - at >= sizeof(uint32_t))
+        {
+            uint32_t len;
+            memcpy(&len, buf.data() + at, sizeof(len));
+            len = ntohl(len);
+            if (len > STREAM_MAX_MSG)
+            {
+                cerr << "[" << gUID << "] WARN: oversized stream frame, closing connection\n";
+                dropConn(fd);
+                return;
+            }
+            if (buf.size() - at - sizeof(uint32_t) < len)
+                break;
+            ready.emplace_back(buf, at + sizeof(uint32_t), len);
+            at += sizeof(uint32_t) + len;
+        }
+        buf.erase(0, at);
+    }
+
+public:
+    explicit StreamTransport(bool useTcp) : tcp(useTcp) {}
+    const char *name() const override { return tcp ? "tcp" : "unix"; }
+
+    bool openSelf(const string &uid, string &endpoint) override
+    {
+        if (tcp)
+        {
+            const char *host = getenv("SYNCTEXT_TCP_HOST");
+            string h = host ? host : "127.0.0.1";
+            struct sockaddr_in sa;
+            if (!parseTcp(h + ":0", sa))
+            {
+                cerr << "[" << uid << "] bad SYNCTEXT_TCP_HOST " << h << "\n";
+                return false;
+            }
+            listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd == -1)
+            {
+                perror("tcp socket");
+                return false;
+            }
+            int one = 1;
+            setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(listenFd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+            {
+                perror("tcp bind");
+                closeSelf();
+                return false;
+            }
+            socklen_t sl = sizeof(sa);
+            getsockname(listenFd, (struct sockaddr *)&sa, &sl);
+            endpoint = "tcp:" + h + ":" + to_string(ntohs(sa.sin_port));
+        }
+        else
+        {
+            sockPath = UNIX_SOCK_PREFIX + uid + ".sock";
+            struct sockaddr_un sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sun_family = AF_UNIX;
+            strncpy(sa.sun_path, sockPath.c_str(), sizeof(sa.sun_path) - 1);
+            unlink(sockPath.c_str());
+            listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd == -1 || bind(listenFd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+            {
+                perror(("unix bind " + sockPath).c_str());
+                closeSelf();
+                return false;
+            }
+            endpoint = "unix:" + sockPath;
+        }
+        if (endpoint.size() >= NAME_QLEN)
+        {
+            cerr << "[" << uid << "] endpoint too long: " << endpoint << "\n";
+            closeSelf();
+            return false;
+        }
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        if (listen(listenFd, STREAM_BACKLOG) == -1 || ep == -1)
+        {
+            perror("listen");
+            closeSelf();
+            return false;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = listenFd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, listenFd, &ev);
+        cerr << "[" << uid << "] Listening on " << endpoint << "\n";
+        return true;
+    }
+
+    void closeSelf() override
+    {
+        for (auto &kv : conns)
+            close(kv.second);
+        conns.clear();
+        connecting.clear();
+        for (auto &kv : inbuf)
+            close(kv.first);
+        inbuf.clear();
+        if (listenFd != -1)
+            close(listenFd);
+        if (ep != -1)
+            close(ep);
+        listenFd = ep = -1;
+        if (!sockPath.empty())
+            unlink(sockPath.c_str());
+    }
+
+    size_t maxMessage() const override { return STREAM_MAX_MSG; }
+
+    bool receive(string &msg, int timeout_ms) override
+    {
+        if (ready.empty() && ep != -1)
+        {
+            struct epoll_event events[32];
+            int n = epoll_wait(ep, events, 32, timeout_ms);
+            for (int e = 0; e < n; ++e)
+            {
+                int fd = events[e].data.fd;
+                if (fd != listenFd)
+                {
+                    readConn(fd);
+                    continue;
+                }
+                int c;
+                while ((c = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+                {
+                    struct epoll_event cev;
+                    memset(&cev, 0, sizeof(cev));
+                    cev.events = EPOLLIN;
+                    cev.data.fd = c;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, c, &cev);
+                    inbuf[c];
+                }
+            }
+        }
+        if (ready.empty())
+            return false;
+        msg = std::move(ready.front());
+        ready.pop_front();
+        return true;
+    }
+
+    void forget(const string &endpoint) override
+    {
+        auto it = conns.find(endpoint);
+        if (it == conns.end())
+            return;
+        connecting.erase(it->second);
+        close(it->second);
+        conns.erase(it);
+    }
+
+    int sendFd(const string &endpoint) const override
+    {
+        auto it = conns.find(endpoint);
+        return it == conns.end() ? -1 : it->second;
+    }
+
+    // Write queued frames with as few syscalls as the iovec limit allows. A
+    // connection that fails is dropped; the frame it was cut off in is sent
+    // again in full on the next one (a peer that restarted reconnects here).
+    // Connecting never blocks either: until it completes the queue waits for
+    // EPOLLOUT like one whose peer is full.
+    SendStatus flush(OutQueue &q) override
+    {
+        auto it = conns.find(q.endpoint);
+        if (it == conns.end())
+        {
+            int fd = connectTo(q.endpoint);
+            if (fd == -1)
+                return SendStatus::Failed;
+            it = conns.emplace(q.endpoint, fd).first;
+            q.offset = 0;
+        }
+        if (connecting.count(it->second))
+        {
+            SendStatus st = finishConnect(it->second);
+            if (st == SendStatus::Again)
+                return st;
+            if (st == SendStatus::Failed)
+            {
+                close(it->second);
+                conns.erase(it);
+                return st;
+            }
+        }
+
+        const size_t IOV_CHUNK = 512; // frames per sendmsg; two iovecs each
+        while (!q.frames.empty())
+        {
+            size_t n = min(IOV_CHUNK, q.frames.size());
+            vector<uint32_t> hdrs(n);
+            vector<struct iovec> iov(2 * n);
+            for (size_t k = 0; k < n; ++k)
+            {
+                const string &m = q.frames[k];
+                hdrs[k] = htonl((uint32_t)m.size());
+                iov[2 * k].iov_base = &hdrs[k];
+                iov[2 * k].iov_len = sizeof(uint32_t);
+                iov[2 * k + 1].iov_base = const_cast<char *>(m.data());
+                iov[2 * k + 1].iov_len = m.size();
+            }
+            // skip what an earlier call already wrote of the first frame
+            size_t at = 0, skip = q.offset;
+            while (skip && skip >= iov[at].iov_len)
+                skip -= iov[at++].iov_len;
+            iov[at].iov_base = (char *)iov[at].iov_base + skip;
+            iov[at].iov_len -= skip;
+
+            struct msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_iov = &iov[at];
+            mh.msg_iovlen = min<size_t>(iov.size() - at, IOV_MAX);
+            ssize_t w = sendmsg(it->second, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (w < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return SendStatus::Again;
+                close(it->second);
+                conns.erase(it);
+                q.offset = 0;
+                return SendStatus::Failed;
+            }
+
+            size_t done = q.offset + (size_t)w;
+            while (!q.frames.empty() && done >= sizeof(uint32_t) + q.frames.front().size())
+            {
+                done -= sizeof(uint32_t) + q.frames.front().size();
+                countSent(q, q.frames.front());
+                q.frames.pop_front();
+            }
+            q.offset = done;
+        }
+        return SendStatus::Sent;
+    }
+};
+
+static MqTransport gMqTransport;
+static StreamTransport gUnixTransport(false);
+static StreamTransport gTcpTransport(true);
+Transport *gTransport = nullptr; // receiving backend of this process
+
+Transport *transportByName(const string &kind)
+{
+    if (kind == "mq")
+        return &gMqTransport;
+    if (kind == "unix")
+        return &gUnixTransport;
+    if (kind == "tcp")
+        return &gTcpTransport;
+    return nullptr;
+}
+// Sending side: pick the backend from the endpoint's scheme.
+Transport *transportFor(const string &endpoint)
+{
+    if (endpoint.compare(0, 5, "unix:") == 0)
+        return &gUnixTransport;
+    if (endpoint.compare(0, 4, "tcp:") == 0)
+        return &gTcpTransport;
+    return &gMqTransport;
+}
+
+// SENDER THREAD
+// The main loop only queues frames; this thread owns every outbound
+// descriptor and never blocks on a peer. Each peer has a bounded queue. A
+// peer that is full (EAGAIN) waits for EPOLLOUT on its descriptor while the
+// others carry on; an unreachable one is retried on a timer and its queue is
+// dropped after SEND_MAX_FAILURES attempts in a row. Sequenced messages stay
+// held until acked: once a peer's queue has drained, those unacked for
+// longer than its retransmission timeout are queued again, backing off up
+// to SEND_RTO_MAX_MS while nothing gets through.
+const size_t SEND_QUEUE_MAX = 4096; // frames per peer; the oldest go first
+const int SEND_RETRY_MS = 100;
+const int SEND_MAX_FAILURES = 6;
+const size_t SEND_UNACKED_MAX = 4096; // held per peer; past it the oldest are given up
+const int SEND_RTO_MS = 1000;
+const int SEND_RTO_MAX_MS = 8000;
+
+// A fresh stream id, larger than any this replica used before, in this run
+// or an earlier one (microseconds of wall clock, bumped past the last id).
+// Sender thread.
+static uint64_t linkNewStream()
+{
+    static uint64_t last = 0;
+    uint64_t now = (uint64_t)chrono::duration_cast<chrono::microseconds>(
+                       chrono::system_clock::now().time_since_epoch()).count();
+    last = max(last + 1, now);
+    return last;
+}
+
+class Sender
+{
+    enum class CmdKind
+    {
+        Send,      // frames as they are
+        Sequenced, // frames get a link header and are held until acked
+        Forget,
+        Ack // frames[0] is an ack from the peer
+    };
+    struct Cmd
+    {
+        Transport *t;
+        string endpoint;
+        vector<string> frames;
+        CmdKind kind;
+    };
+    mutex mu;
+    vector<Cmd> inbox; // in the order the main loop issued them
+    atomic<bool> stopping{false};
+    int wakeFd = -1;
+    int ep = -1;
+    thread th;
+    map<string, OutQueue> queues; // by endpoint; sender thread only
+
+    void kick()
+    {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("sender wake");
+    }
+
+    void unwatch(OutQueue &q)
+    {
+        if (q.waitFd == -1)
+            return;
+        epoll_ctl(ep, EPOLL_CTL_DEL, q.waitFd, nullptr);
+        q.waitFd = -1;
+    }
+
+    void takeInbox()
+    {
+        vector<Cmd> cmds;
+        {
+            lock_guard<mutex> lk(mu);
+            cmds.swap(inbox);
+        }
+        for (Cmd &c : cmds)
+        {
+            if (c.kind == CmdKind::Ack)
+            {
+                takeAck(c.frames[0]);
+                continue;
+            }
+            if (c.kind == CmdKind::Forget)
+            {
+                // the peer left or restarted: whatever was queued for it is moot
+                auto it = queues.find(c.endpoint);
+                if (it != queues.end())
+                {
+                    unwatch(it->second);
+                    queues.erase(it);
+                }
+                c.t->forget(c.endpoint);
+                continue;
+            }
+            OutQueue &q = queues[c.endpoint];
+            q.t = c.t;
+            q.endpoint = c.endpoint;
+            if (c.kind == CmdKind::Sequenced)
+            {
+                sequence(q, c.frames);
+            }
+            else
+            {
+                for (string &f : c.frames)
+                    q.frames.push_back(std::move(f));
+            }
+            size_t dropped = 0;
+            while (q.frames.size() > SEND_QUEUE_MAX)
+            {
+                // never cut a frame that is half written
+                q.frames.erase(q.frames.begin() + (q.offset ? 1 : 0));
+                dropped++;
+            }
+            if (dropped)
+                cerr << "[" << gUID << "] WARN: send queue full for " << c.endpoint << ", dropped "
+                     << dropped << " oldest frame(s)\n";
+        }
+    }
+
+    void sequence(OutQueue &q, vector<string> &frames)
+    {
+        if (!q.stream)
+        {
+            q.stream = linkNewStream();
+            q.rtoMs = SEND_RTO_MS;
+        }
+        auto now = chrono::steady_clock::now();
+        size_t given = 0;
+        for (string &f : frames)
+        {
+            uint64_t seq = q.nextSeq++;
+            while (q.unacked.size() >= SEND_UNACKED_MAX)
+            {
+                q.unacked.erase(q.unacked.begin());
+                given++;
+            }
+            uint64_t base = q.unacked.empty() ? seq : q.unacked.begin()->first;
+            string w = linkWrap(q.stream, seq, base, f);
+            q.frames.push_back(w);
+            q.unacked.emplace(seq, Unacked{std::move(w), now});
+        }
+        if (given)
+            cerr << "[" << gUID << "] WARN: " << q.endpoint << " is not acking, gave up on " << given
+                 << " message(s)\n";
+    }
+
+    void takeAck(const string &msg)
+    {
+        uint64_t stream, cum;
+        vector<pair<uint64_t, uint64_t>> sacks;
+        if (!linkParseAck(msg, stream, cum, sacks))
+            return;
+        for (auto &kv : queues)
+        {
+            OutQueue &q = kv.second;
+            if (q.stream != stream)
+                continue;
+            if (!q.unacked.empty() && q.unacked.begin()->first <= cum)
+                q.rtoMs = SEND_RTO_MS; // the peer is making progress
+            q.unacked.erase(q.unacked.begin(), q.unacked.upper_bound(cum));
+            for (const auto &r : sacks)
+                q.unacked.erase(q.unacked.lower_bound(r.first), q.unacked.upper_bound(r.second));
+            return;
+        }
+    }
+
+    // Queue again whatever has waited out the timeout, once the peer has
+    // taken everything queued before (never twice in the queue).
+    void retransmit(OutQueue &q, chrono::steady_clock::time_point now)
+    {
+        if (q.unacked.empty() || !q.frames.empty() || q.waitFd != -1)
+            return;
+        size_t n = 0;
+        for (auto &kv : q.unacked)
+        {
+            if (now - kv.second.sentAt < chrono::milliseconds(q.rtoMs))
+                continue;
+            q.frames.push_back(kv.second.frame);
+            kv.second.sentAt = now;
+            n++;
+        }
+        if (!n)
+            return;
+        cerr << "[" << gUID << "] Retransmitting " << n << " message(s) to " << q.endpoint << "\n";
+        q.rtoMs = min(q.rtoMs * 2, SEND_RTO_MAX_MS);
+    }
+
+    void pump(OutQueue &q)
+    {
+        SendStatus st = q.t->flush(q);
+        if (q.sentBytes)
+        {
+            cerr << "[" << gUID << "] Sent to " << q.endpoint << " (" << q.sentBytes << " bytes)\n";
+            q.sentBytes = 0;
+        }
+        if (st == SendStatus::Sent)
+        {
+            q.failures = 0;
+            return;
+        }
+        if (st == SendStatus::Again)
+        {
+            q.failures = 0;
+            int fd = q.t->sendFd(q.endpoint);
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLOUT;
+            ev.data.ptr = &q;
+            if (fd != -1 && epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == 0)
+                q.waitFd = fd;
+            else
+                q.retryAt = chrono::steady_clock::now() + chrono::milliseconds(SEND_RETRY_MS);
+            return;
+        }
+        if (++q.failures >= SEND_MAX_FAILURES)
+        {
+            cerr << "[" << gUID << "] WARN: failed to send to " << q.endpoint << " after retries, dropping "
+                 << q.frames.size() << " frame(s)\n";
+            q.frames.clear();
+            q.offset = 0;
+            q.failures = 0;
+            return;
+        }
+        q.retryAt = chrono::steady_clock::now() + chrono::milliseconds(SEND_RETRY_MS);
+    }
+
+    void loop()
+    {
+        struct epoll_event events[32];
+        for (;;)
+        {
+            bool last = stopping.load(); // one more non-blocking pass on exit
+            takeInbox();
+            auto now = chrono::steady_clock::now();
+            bool timed = false;
+            for (auto &kv : queues)
+            {
+                OutQueue &q = kv.second;
+                if (!last)
+                    retransmit(q, now);
+                timed = timed || !q.unacked.empty();
+                if (q.frames.empty() || q.waitFd != -1)
+                    continue;
+                if (q.retryAt <= now || last)
+                    pump(q);
+                timed = timed || (!q.frames.empty() && q.waitFd == -1);
+            }
+            if (last)
+                break;
+
+            int n = epoll_wait(ep, events, 32, timed ? SEND_RETRY_MS : -1);
+            for (int e = 0; e < n; ++e)
+            {
+                if (!events[e].data.ptr)
+                {
+                    uint64_t v;
+                    if (read(wakeFd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+                        perror("sender wake");
+                    continue;
+                }
+                OutQueue &q = *static_cast<OutQueue *>(events[e].data.ptr);
+                unwatch(q);
+                q.retryAt = {};
+            }
+        }
+
+        for (auto &kv : queues)
+        {
+            unwatch(kv.second);
+            if (!kv.second.frames.empty())
+                cerr << "[" << gUID << "] WARN: " << kv.second.frames.size() << " frame(s) for " << kv.first
+                     << " left unsent at exit\n";
+        }
+        queues.clear();
+    }
+
+public:
+    bool start()
+    {
+        wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        ep = epoll_create1(EPOLL_CLOEXEC);
+        if (wakeFd == -1 || ep == -1)
+        {
+            perror("sender setup");
+            return false;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(ep, EPOLL_CTL_ADD, wakeFd, &ev);
+        stopping.store(false);
+        th = thread(&Sender::loop, this);
+        return true;
+    }
+    // Makes one last non-blocking attempt at everything queued, then joins.
+    void stop()
+    {
+        if (!th.joinable())
+            return;
+        stopping.store(true);
+        kick();
+        th.join();
+        close(wakeFd);
+        close(ep);
+        wakeFd = ep = -1;
+    }
+    // `sequenced` frames are numbered and held until the peer acks them;
+    // only peers that speak the link header (not the broker) get them.
+    void enqueue(Transport *t, const string &endpoint, vector<string> frames, bool sequenced = true)
+    {
+        if (frames.empty())
+            return;
+        {
+            lock_guard<mutex> lk(mu);
+            inbox.push_back(Cmd{t, endpoint, std::move(frames), sequenced ? CmdKind::Sequenced : CmdKind::Send});
+        }
+        kick();
+    }
+    // An ack received by the listener.
+    void ack(string msg)
+    {
+        {
+            lock_guard<mutex> lk(mu);
+            inbox.push_back(Cmd{nullptr, string(), {std::move(msg)}, CmdKind::Ack});
+        }
+        kick();
+    }
+    void forget(Transport *t, const string &endpoint)
+    {
+        if (!th.joinable())
+        {
+            t->forget(endpoint);
+            return;
+        }
+        {
+            lock_guard<mutex> lk(mu);
+            inbox.push_back(Cmd{t, endpoint, {}, CmdKind::Forget});
+        }
+        kick();
+    }
+};
+static Sender gSender;
+
+// PEER CACHE
+// Resolved once per registry generation instead of on every send or render;
+// descriptors of peers that left or re-registered are released on rebuild.
+struct Peer
+{
+    string uid;
+    string endpoint;
+    uint32_t epoch = 0;
+    Transport *t = nullptr;
+    int slot = -1;
+    map<string, vector<pair<int, int>>> ranges; // by document; absent = whole
+    set<string> shared;                         // documents it keeps in shared memory
+
+    bool follows(const string &doc) const { return !ranges.count(doc); }
+    bool wants(const string &doc, int line) const
+    {
+        auto it = ranges.find(doc);
+        if (it == ranges.end())
+            return true;
+        for (const auto &r : it->second)
+        {
+            if (line >= r.first && line < r.second)
+                return true;
+        }
+        return false;
+    }
+};
+struct PeerCache
+{
+    bool valid = false;
+    uint32_t generation = 0;
+    vector<Peer> peers; // active peers other than us, slot order
+    // relay tree fan-out agreed by every active peer (0 = direct fan-out);
+    // only used while nobody follows a partial document
+    uint32_t relayK = 0;
+    size_t minMessage = 0; // smallest frameBudget() among peers
+};
+static PeerCache gPeers;
+
+const PeerCache &peerCache(ShmRegistry *reg)
+{
+    uint32_t gen = __atomic_load_n(&reg->generation, __ATOMIC_SEQ_CST);
+    if (gPeers.valid && gen == gPeers.generation)
+        return gPeers;
+
+    PeerCache fresh;
+    fresh.valid = true;
+    fresh.generation = gen;
+    bool relay = true, anyRanges = false;
+    uint32_t k = 0;
+    for (size_t i = 0; i < MAX_USERS; ++i)
+    {
+        if (__atomic_load_n(&reg->users[i].active, __ATOMIC_SEQ_CST) != 1)
+            continue;
+        string uid = string(reg->users[i].uid);
+        if (uid.empty())
+            continue;
+        uint32_t fan = reg->users[i].relayFanout;
+        relay = relay && fan > 0 && (k == 0 || fan == k);
+        k = fan;
+        anyRanges = anyRanges || reg->users[i].numRanges > 0;
+        if (uid == gUID)
+            continue;
+        Peer p;
+        p.slot = (int)i;
+        p.uid = uid;
+        p.endpoint = reg->users[i].qName[0] ? string(reg->users[i].qName) : (string("/mq_") + uid);
+        p.epoch = __atomic_load_n(&reg->users[i].epoch, __ATOMIC_SEQ_CST);
+        p.t = transportFor(p.endpoint);
+        uint32_t nr = min<uint32_t>(reg->users[i].numRanges, MAX_SUB_RANGES);
+        for (uint32_t r = 0; r < nr; ++r)
+        {
+            const SubRange &sr = reg->users[i].ranges[r];
+            p.ranges[string(sr.docId, strnlen(sr.docId, DOC_ID_LEN))].emplace_back(sr.lo, sr.hi);
+        }
+        uint32_t ns = min<uint32_t>(reg->users[i].numShared, MAX_SHARED_DOCS);
+        for (uint32_t d = 0; d < ns; ++d)
+            p.shared.insert(string(reg->users[i].sharedDocs[d], strnlen(reg->users[i].sharedDocs[d], DOC_ID_LEN)));
+        fresh.peers.push_back(p);
+        fresh.minMessage = fresh.minMessage ? min(fresh.minMessage, p.t->frameBudget()) : p.t->frameBudget();
+    }
+    fresh.relayK = (relay && !anyRanges) ? k : 0;
+
+    for (const Peer &old : gPeers.peers)
+    {
+        bool kept = false;
+        for (const Peer &p : fresh.peers)
+            kept = kept || (p.endpoint == old.endpoint && p.epoch == old.epoch);
+        if (!kept)
+            gSender.forget(old.t, old.endpoint);
+    }
+    gPeers = std::move(fresh);
+    return gPeers;
+}
+
+// Children of this peer in the relay tree rooted at `origin`. Members are
+// ranked by slot starting at the origin; rank r feeds ranks r*k+1 .. r*k+k,
+// so every peer sends at most k copies whatever the group size.
+vector<const Peer *> relayChildren(const PeerCache &pc, const string &origin)
+{
+    vector<pair<int, const Peer *>> members; // (slot, peer); nullptr = us
+    for (const Peer &p : pc.peers)
+        members.emplace_back(p.slot, &p);
+    members.emplace_back(gMySlot, nullptr);
+    sort(members.begin(), members.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    size_t n = members.size(), root = n, self = n;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (!members[i].second)
+            self = i;
+        if (members[i].second ? members[i].second->uid == origin : origin == gUID)
+            root = i;
+    }
+    vector<const Peer *> out;
+    if (pc.relayK == 0 || root == n || self == n)
+        return out;
+    size_t rank = (self + n - root) % n;
+    for (size_t c = rank * pc.relayK + 1; c <= rank * pc.relayK + pc.relayK && c < n; ++c)
+        out.push_back(members[(root + c) % n].second);
+    return out;
+}
@@ -0,0 +1,514 @@
+#include "headers.cpp"
+#include "compress.cpp"
+
+// WIRE (batching + fragmentation)
+// A broadcast batch is packed as repeated <len>|<serialized update> records,
+// LZ-compressed when that pays off, and cut into as few frames as fit in
+// gMQ_msgsize:
+// F|uid|msgid|idx|count|flags|payload   (flags: 'z' compressed, 'r' raw)
+// Frames relayed by a broker are prefixed with its sequence number: S|seq|F|...
+// Anything not starting with "F|" is treated as a single legacy update.
+// In relay mode peers also forward frames they receive, unchanged.
+const bool WIRE_COMPRESS = true;
+const size_t WIRE_COMPRESS_MIN = 512; // bytes; smaller batches go raw
+const int WIRE_REASM_TIMEOUT_SEC = 30;
+const size_t WIRE_LEN_DIGITS = 12; // record length prefix; more is a corrupt batch
+
+static atomic<uint64_t> gWireMsgId{(uint64_t)time(nullptr) << 16};
+static uint64_t gLastBrokerSeq = 0; // listener thread only
+
+string wirePackBatch(const vector<string> &records)
+{
+    size_t total = 0;
+    for (const auto &r : records)
+        total += r.size() + 12;
+    string s;
+    s.reserve(total);
+    for (const auto &r : records)
+    {
+        s += to_string(r.size());
+        s += '|';
+        s += r;
+    }
+    return s;
+}
+bool wireUnpackBatch(const string &s, vector<string> &records)
+{
+    size_t pos = 0;
+    while (pos < s.size())
+    {
+        size_t bar = findByte(s, '|', pos);
+        if (bar == string::npos || bar == pos || bar - pos > WIRE_LEN_DIGITS)
+            return false;
+        size_t len = 0;
+        for (size_t k = pos; k < bar; ++k)
+        {
+            if (!isdigit((unsigned char)s[k]))
+                return false;
+            len = len * 10 + (s[k] - '0');
+        }
+        pos = bar + 1;
+        if (len > s.size() - pos)
+            return false;
+        records.emplace_back(s, pos, len);
+        pos += len;
+    }
+    return true;
+}
+
+static string wireFrameHeader(const string &uid, uint64_t msgid, size_t idx, size_t count, char flags)
+{
+    string h = "F|";
+    h += uid;
+    h += '|';
+    h += to_string(msgid);
+    h += '|';
+    h += to_string(idx);
+    h += '|';
+    h += to_string(count);
+    h += '|';
+    h += flags;
+    h += '|';
+    return h;
+}
+
+// Encode a batch of serialized updates into ready-to-send frames.
+vector<string> wireEncodeBatch(const vector<string> &records, const string &uid, size_t max_msg)
+{
+    string payload = wirePackBatch(records);
+    char flags = 'r';
+    if (WIRE_COMPRESS && payload.size() >= WIRE_COMPRESS_MIN)
+    {
+        string z = lzCompress(payload);
+        if (z.size() < payload.size())
+        {
+            payload.swap(z);
+            flags = 'z';
+        }
+    }
+
+    uint64_t msgid = gWireMsgId.fetch_add(1);
+    // Header length depends on the digit count of idx/count: settle on the
+    // smallest frame count whose worst-case header still leaves room.
+    size_t count = 1, cap = 0;
+    for (;;)
+    {
+        size_t hdr = wireFrameHeader(uid, msgid, count - 1, count, flags).size();
+        if (hdr >= max_msg)
+        {
+            cerr << "[" << gUID << "] WARN: message size " << max_msg << " leaves no room for a frame header, dropping "
+                 << records.size() << " record(s)\n";
+            return {};
+        }
+        cap = max_msg - hdr;
+        size_t need = max<size_t>(1, (payload.size() + cap - 1) / cap);
+        if (need <= count)
+            break;
+        count = need;
+    }
+
+    vector<string> frames;
+    frames.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t off = i * cap;
+        size_t len = min(cap, payload.size() - min(off, payload.size()));
+        string f = wireFrameHeader(uid, msgid, i, count, flags);
+        f.append(payload, min(off, payload.size()), len);
+        frames.push_back(std::move(f));
+    }
+    return frames;
+}
+
+// REASSEMBLY (listener thread only)
+struct WirePartial
+{
+    size_t have = 0;
+    vector<string> parts;
+    vector<bool> seen;
+    time_t first = 0;
+};
+static map<string, WirePartial> gWirePartials;
+
+static void wireEvictStale()
+{
+    time_t now = time(nullptr);
+    for (auto it = gWirePartials.begin(); it != gWirePartials.end();)
+    {
+        if (now - it->second.first > WIRE_REASM_TIMEOUT_SEC)
+        {
+            cerr << "[" << gUID << "] WARN: dropping incomplete message " << it->first << "\n";
+            it = gWirePartials.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+// Feed one received mq message. Appends every completed update record to
+// `records`; returns false if the message was malformed.
+bool wireAccept(const string &msg, vector<string> &records)
+{
+    if (msg.compare(0, 2, "S|") == 0)
+    {
+        size_t bar = msg.find('|', 2);
+        if (bar == string::npos)
+            return false;
+        uint64_t seq = strtoull(msg.c_str() + 2, nullptr, 10);
+        if (gLastBrokerSeq != 0 && seq > gLastBrokerSeq + 1)
+            cerr << "[" << gUID << "] WARN: missed " << (seq - gLastBrokerSeq - 1) << " broker message(s)\n";
+        gLastBrokerSeq = max(gLastBrokerSeq, seq);
+        return wireAccept(msg.substr(bar + 1), records);
+    }
+    if (msg.compare(0, 2, "F|") != 0)
+    {
+        records.push_back(msg);
+        return true;
+    }
+
+    size_t pos = 2;
+    string f[5];
+    for (int k = 0; k < 5; ++k)
+    {
+        size_t bar = findByte(msg, '|', pos);
+        if (bar == string::npos)
+            return false;
+        f[k] = msg.substr(pos, bar - pos);
+        pos = bar + 1;
+    }
+    size_t idx, count;
+    try
+    {
+        idx = stoul(f[2]);
+        count = stoul(f[3]);
+    }
+    catch (...)
+    {
+        return false;
+    }
+    if (count == 0 || idx >= count || f[4].size() != 1)
+        return false;
+    char flags = f[4][0];
+
+    string payload;
+    if (count == 1)
+    {
+        payload = msg.substr(pos);
+    }
+    else
+    {
+        wireEvictStale();
+        string key = f[0] + "|" + f[1];
+        WirePartial &p = gWirePartials[key];
+        if (p.parts.empty())
+        {
+            p.parts.resize(count);
+            p.seen.assign(count, false);
+            p.first = time(nullptr);
+        }
+        if (p.parts.size() != count)
+            return false;
+        if (!p.seen[idx])
+        {
+            p.seen[idx] = true;
+            p.parts[idx] = msg.substr(pos);
+            p.have++;
+        }
+        if (p.have < count)
+            return true;
+        for (auto &part : p.parts)
+            payload += part;
+        gWirePartials.erase(key);
+    }
+
+    if (flags == 'z')
+    {
+        string raw;
+        if (!lzDecompress(payload, raw))
+            return false;
+        payload.swap(raw);
+    }
+    else if (flags != 'r')
+        return false;
+    return wireUnpackBatch(payload, records);
+}
+
+// RELAY DEDUP
+// In relay mode a frame can reach a peer twice while the tree is rebuilt
+// after a join or leave. Frames are identified by uid|msgid|idx and the
+// last RELAY_DEDUP_WINDOW ids are remembered (listener thread only).
+const size_t RELAY_DEDUP_WINDOW = 8192;
+static unordered_set<string> gRelaySeen;
+static deque<string> gRelaySeenOrder;
+
+// The uid|msgid|idx id of an F| frame; false if it has none.
+static bool wireRelayId(const string &msg, string &id)
+{
+    // F|uid|msgid|idx|...
+    size_t a = msg.find('|', 2);
+    size_t b = (a == string::npos) ? a : msg.find('|', a + 1);
+    size_t c = (b == string::npos) ? b : msg.find('|', b + 1);
+    if (msg.compare(0, 2, "F|") != 0 || c == string::npos)
+        return false;
+    id = msg.substr(2, c - 2);
+    return true;
+}
+
+// True if the frame was taken before (or is not a relay frame).
+bool wireRelaySeen(const string &msg)
+{
+    string id;
+    return !wireRelayId(msg, id) || gRelaySeen.count(id);
+}
+
+// Record the frame as taken; called once it is safely queued, so a frame
+// that could not be is taken when it comes again.
+void wireRelayRemember(const string &msg)
+{
+    string id;
+    if (!wireRelayId(msg, id) || !gRelaySeen.insert(id).second)
+        return;
+    gRelaySeenOrder.push_back(std::move(id));
+    if (gRelaySeenOrder.size() > RELAY_DEDUP_WINDOW)
+    {
+        gRelaySeen.erase(gRelaySeenOrder.front());
+        gRelaySeenOrder.pop_front();
+    }
+}
+
+// SEQUENCED DELIVERY (receiving side; the sending side is in SENDER THREAD)
+// Every message one replica sends another travels inside a link header:
+//   Q|uid|stream|seq|base|message
+// seq counts up from 1 on each sender->receiver stream; a new stream id
+// means the sender started over (restart, or it forgot us). Stream ids only
+// grow, so a retransmission left over from an old stream is told apart from
+// a new one and dropped. base is the lowest seq the sender still holds:
+// anything below it is never coming. The receiver hands messages on in seq
+// order, exactly once: an update's columns refer to its author's previous
+// state, so one applied ahead of an earlier edit from the same site, or
+// twice, corrupts the line. Frames past a gap are held until it fills or
+// base passes it. The receiver acknowledges what it has:
+//   A|uid|stream|cum|lo-hi,lo-hi...
+// cum covers every seq up to it; the ranges list frames held past the first
+// gap, so the sender retransmits only what is missing. Messages without a
+// link header (broker traffic, acks) are taken as they come.
+const size_t LINK_HEADER_RESERVE = 128; // frame budget kept for the Q| header
+const size_t LINK_SACK_RANGES = 16;     // ranges past the first gap per ack
+const size_t LINK_HOLD_MAX = 4096;      // frames held past a gap per sender
+
+// SYNCTEXT_LINK_LOSS=<percent> drops that share of incoming sequenced
+// messages on purpose, to watch retransmission at work.
+static int linkLossPercent()
+{
+    const char *env = getenv("SYNCTEXT_LINK_LOSS");
+    return env ? max(0, min(100, atoi(env))) : 0;
+}
+static const int gLinkLoss = linkLossPercent();
+
+bool linkInjectLoss()
+{
+    static thread_local mt19937 rng(random_device{}());
+    return gLinkLoss && (int)(rng() % 100) < gLinkLoss;
+}
+
+struct LinkHeader
+{
+    string uid;
+    uint64_t stream = 0, seq = 0, base = 0;
+};
+
+struct LinkIn
+{
+    uint64_t stream = 0;
+    uint64_t next = 1;          // every seq below has been handed on
+    map<uint64_t, string> held; // arrived past a gap, by seq
+    bool dirty = false;    // owes the sender an ack
+    uint64_t dups = 0, lost = 0;
+};
+static mutex gLinkMu;
+static map<string, LinkIn> gLinkIn; // by sender uid
+
+string linkWrap(uint64_t stream, uint64_t seq, uint64_t base, const string &msg)
+{
+    string s;
+    s.reserve(msg.size() + 80);
+    s += "Q|";
+    s += gUID;
+    s += '|';
+    s += to_string(stream);
+    s += '|';
+    s += to_string(seq);
+    s += '|';
+    s += to_string(base);
+    s += '|';
+    s += msg;
+    return s;
+}
+
+// Strip the link header off `msg`; false (msg untouched) if it has none or
+// it is malformed.
+bool linkUnwrap(string &msg, LinkHeader &h)
+{
+    if (msg.compare(0, 2, "Q|") != 0)
+        return false;
+    size_t pos = 2;
+    string_view f[4];
+    for (int k = 0; k < 4; ++k)
+    {
+        size_t bar = findByte(msg, '|', pos);
+        if (bar == string::npos)
+            return false;
+        f[k] = string_view(msg).substr(pos, bar - pos);
+        pos = bar + 1;
+    }
+    uint64_t *num[3] = {&h.stream, &h.seq, &h.base};
+    for (int k = 0; k < 3; ++k)
+    {
+        auto r = from_chars(f[k + 1].data(), f[k + 1].data() + f[k + 1].size(), *num[k]);
+        if (r.ec != errc() || r.ptr != f[k + 1].data() + f[k + 1].size())
+            return false;
+    }
+    if (h.seq == 0)
+        return false;
+    h.uid.assign(f[0]);
+    msg.erase(0, pos);
+    return true;
+}
+
+// Hand on the held frames that are next in line.
+static void linkDrain(LinkIn &in, vector<string> &ready)
+{
+    auto it = in.held.begin();
+    while (it != in.held.end() && it->first == in.next)
+    {
+        ready.push_back(std::move(it->second));
+        it = in.held.erase(it);
+        in.next++;
+    }
+}
+
+// Take in h's message; `ready` receives, in seq order, the messages that
+// can be handed on now (this one and any it unblocked). A duplicate or a
+// frame of an older stream yields nothing, and neither does one past a gap
+// when LINK_HOLD_MAX frames are already held: it is not acked, so the
+// sender retransmits it later. Listener thread.
+void linkAccept(const LinkHeader &h, string &&msg, vector<string> &ready)
+{
+    lock_guard<mutex> lk(gLinkMu);
+    LinkIn &in = gLinkIn[h.uid];
+    if (h.stream < in.stream)
+    {
+        in.dups++;
+        return;
+    }
+    if (h.stream > in.stream)
+    {
+        // new stream: whatever it sent before this frame is not ours to wait for
+        if (!in.held.empty())
+            cerr << "[" << gUID << "] WARN: " << in.held.size() << " message(s) from " << h.uid
+                 << " held past a gap are dropped (the sender started over)\n";
+        in = LinkIn();
+        in.stream = h.stream;
+        in.next = max<uint64_t>(h.base, 1);
+    }
+    in.dirty = true;
+    if (h.base > in.next)
+    {
+        // what arrived below base is handed on in order; the rest is lost
+        uint64_t missing = h.base - in.next;
+        while (!in.held.empty() && in.held.begin()->first < h.base)
+        {
+            missing--;
+            ready.push_back(std::move(in.held.begin()->second));
+            in.held.erase(in.held.begin());
+        }
+        in.lost += missing;
+        if (missing)
+            cerr << "[" << gUID << "] WARN: " << missing << " message(s) from " << h.uid
+                 << " are lost (sender no longer holds them)\n";
+        in.next = h.base;
+        linkDrain(in, ready);
+    }
+    if (h.seq < in.next || in.held.count(h.seq))
+    {
+        // the sender evidently missed our ack: it is sent again
+        in.dups++;
+        return;
+    }
+    if (h.seq > in.next)
+    {
+        if (in.held.size() >= LINK_HOLD_MAX)
+            return;
+        if (in.held.empty() || h.seq > in.held.rbegin()->first + 1)
+        {
+            uint64_t from = in.held.empty() ? in.next : in.held.rbegin()->first + 1;
+            cerr << "[" << gUID << "] Gap from " << h.uid << ": waiting for seq " << from << "-" << (h.seq - 1)
+                 << "\n";
+        }
+        in.held.emplace(h.seq, std::move(msg));
+        return;
+    }
+    ready.push_back(std::move(msg));
+    in.next++;
+    linkDrain(in, ready);
+}
+
+// Acks owed, as (sender uid, message). Main loop.
+vector<pair<string, string>> linkTakeAcks()
+{
+    vector<pair<string, string>> out;
+    lock_guard<mutex> lk(gLinkMu);
+    for (auto &kv : gLinkIn)
+    {
+        LinkIn &in = kv.second;
+        if (!in.dirty)
+            continue;
+        in.dirty = false;
+        string a = "A|" + gUID + "|" + to_string(in.stream) + "|" + to_string(in.next - 1) + "|";
+        size_t ranges = 0;
+        for (auto it = in.held.begin(); it != in.held.end() && ranges < LINK_SACK_RANGES; ++ranges)
+        {
+            uint64_t lo = it->first, hi = lo;
+            while (++it != in.held.end() && it->first == hi + 1)
+                hi++;
+            if (ranges)
+                a += ',';
+            a += to_string(lo) + "-" + to_string(hi);
+        }
+        out.emplace_back(kv.first, std::move(a));
+    }
+    return out;
+}
+
+// Parse an ack; false if malformed. Sender thread.
+bool linkParseAck(const string &msg, uint64_t &stream, uint64_t &cum, vector<pair<uint64_t, uint64_t>> &sacks)
+{
+    if (msg.compare(0, 2, "A|") != 0)
+        return false;
+    size_t a = msg.find('|', 2);
+    if (a == string::npos)
+        return false;
+    const char *p = msg.data() + a + 1, *end = msg.data() + msg.size();
+    auto r = from_chars(p, end, stream);
+    if (r.ec != errc() || r.ptr == end || *r.ptr != '|')
+        return false;
+    r = from_chars(r.ptr + 1, end, cum);
+    if (r.ec != errc() || r.ptr == end || *r.ptr != '|')
+        return false;
+    p = r.ptr + 1;
+    while (p < end)
+    {
+        uint64_t lo, hi;
+        r = from_chars(p, end, lo);
+        if (r.ec != errc() || r.ptr == end || *r.ptr != '-')
+            return false;
+        r = from_chars(r.ptr + 1, end, hi);
+        if (r.ec != errc() || hi < lo)
+            return false;
+        sacks.emplace_back(lo, hi);
+        p = r.ptr;
+        if (p < end && *p++ != ',')
+            return false;
+    }
+    return true;
+}